@@ -0,0 +1,290 @@
+#include "node.h"
+
+extern workermap_t	workermap;
+extern blockchain_t	chain;
+
+// The benchmark keeps the target fixed (see chain_next_bits)
+unsigned int	blocktime = 0;
+
+// Matrix of block sizes and difficulties the full mining path is measured over
+static unsigned int	bench_numtx[] = { 1, 1000, 50000 };
+static unsigned int	bench_difficulty[] = { 1, 2, 3 };
+
+// Kernels measured by the hashing benchmark, when supported by this CPU
+static const char	*bench_kernels[] = { "avx512", "shani", "avx2", "sse4", "scalar" };
+
+// Timestamps keep generated transactions unique across the whole run
+static ullint		bench_stamp = 0;
+
+// Accounts and block size of the block execution benchmark
+#define BENCH_EXEC_ACCOUNTS	100000
+#define BENCH_EXEC_NUMTX	50000
+
+
+// Elapsed time in seconds between two monotonic clock samples
+static double	bench_seconds(struct timespec *start, struct timespec *end)
+{
+  return ((end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+
+// Expected number of attempts to find a hash below the target of difficulty
+static double	bench_expected_hashes(int difficulty)
+{
+  unsigned char	target[32];
+  double	value = 0;
+
+  target_from_bits(bits_from_difficulty(difficulty), target);
+  for (int idx = 0; idx < 32; idx++)
+    value = value * 256 + target[idx];
+  return (ldexp(1.0, 256) / (value + 1));
+}
+
+
+// Hash nonces on one core with a kernel and an unreachable target for some seconds
+static void	bench_hash(const char *name, double duration)
+{
+  hashkern_t		*kern = hashkern_select(name);
+  unsigned char		prefix[128];
+  unsigned char		target[32];
+  unsigned char		nonces[HASHKERN_MAX_LANES][32];
+  unsigned char		hashes[HASHKERN_MAX_LANES][32];
+  hashmid_t		mid;
+  struct timespec	start;
+  struct timespec	end;
+  ullint		total = 0;
+  ullint		counter = 0;
+  double		seconds = 0;
+
+  if (kern == NULL || strcmp(kern->name, name) != 0)
+    return;
+  memset(prefix, 0x00, sizeof(prefix));
+  memset(target, 0x00, sizeof(target));
+  memset(nonces, 0x00, sizeof(nonces));
+  sha256_midstate(prefix, sizeof(prefix), &mid);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (seconds < duration)
+    {
+      for (int batch = 0; batch < 256; batch++)
+	{
+	  for (unsigned int lane = 0; lane < kern->lanes; lane++)
+	    be64_store(((blockwork_t *) nonces[lane])->nonce, counter++);
+	  do_mine_hash(kern, &mid, nonces, target, hashes);
+	}
+      total += 256 * kern->lanes;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      seconds = bench_seconds(&start, &end);
+    }
+  std::cout << "BENCH:hash," << kern->name << "," << kern->lanes << ","
+	    << total << "," << seconds << "," << total / seconds << std::endl;
+}
+
+
+// Fill the pool with enough transactions for numblocks blocks, return the time it took
+// Transactions move funds around the predefined accounts so that execution never fails
+static double	bench_fill(unsigned int numtx, unsigned int numblocks)
+{
+  struct timespec	start;
+  struct timespec	end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  trans_pool_lockall();
+  for (unsigned int idx = 0; idx < numtx * numblocks; idx++, bench_stamp++)
+    {
+      transmsg_t	msg;
+      char		buff[16];
+      int		len;
+
+      memset(&msg, 0x00, sizeof(msg));
+      msg.hdr.opcode = OPCODE_SENDTRANS;
+      len = snprintf(buff, sizeof(buff), "%llu", bench_stamp % 101);
+      sha256((unsigned char *) buff, len, msg.data.sender);
+      len = snprintf(buff, sizeof(buff), "%llu", (bench_stamp + 1) % 101);
+      sha256((unsigned char *) buff, len, msg.data.receiver);
+      memcpy(msg.data.amount, "00000000000000000000000000000001", 32);
+      snprintf(buff, sizeof(buff), "%015llu", bench_stamp);
+      memset(msg.data.timestamp, '0', sizeof(msg.data.timestamp));
+      memcpy(msg.data.timestamp + 17, buff, 15);
+      trans_pool_insert(msg);
+    }
+  trans_pool_unlockall();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (bench_seconds(&start, &end));
+}
+
+
+// Mine numblocks blocks through the full do_mine path and report template and block times
+static void	bench_mine(worker_t *worker, unsigned int numtx, int difficulty,
+			   unsigned int numblocks, unsigned int numthreads)
+{
+  minesession_t		*session = worker->miner->session;
+  struct timespec	start;
+  struct timespec	end;
+  double		fill;
+  double		observed;
+
+  // Template buffers are sized for one block size - drop those of the previous run
+  free(session->buff);
+  free(session->nextbuff);
+  session->buff = NULL;
+  session->nextbuff = NULL;
+  session->nextready = false;
+
+  fill = bench_fill(numtx, numblocks);
+  session->mined = 0;
+  session->hashes = 0;
+  session->hashtime = 0;
+  session->templates = 0;
+  session->buildtime = 0;
+
+  // The session is claimed as miner_wake would, but the loop runs on this thread
+  session->running = true;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do_mine(worker, difficulty, numtx);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  observed = bench_seconds(&start, &end);
+
+  double rate = session->hashtime > 0 ? session->hashes / session->hashtime : 0;
+  double expected = rate > 0 ? bench_expected_hashes(difficulty) / rate : 0;
+  std::cout << "BENCH:mine," << numtx << "," << difficulty << "," << numthreads << ","
+	    << session->mined << "," << fill / (numtx * numblocks) << ","
+	    << (session->templates ? session->buildtime / session->templates : 0) << ","
+	    << rate << "," << rate / numthreads << "," << expected << ","
+	    << (session->mined ? observed / session->mined : 0) << std::endl;
+}
+
+
+// Execute then revert one block serially and on numthreads threads
+// Balances are low so that some transfers are skipped and the outcome depends on order:
+// both paths must leave the account table identical after each step
+// Runs execute on forks of the published state, which is left untouched
+// Return false when the parallel runs do not match the serial ones
+static bool	bench_exec(unsigned int numthreads)
+{
+  std::vector<transdata_t>	block(BENCH_EXEC_NUMTX);
+  stateref_t			initial;
+  stateref_t			serial[2];
+  struct timespec		start;
+  struct timespec		end;
+  double			seconds[2][2];
+  int				executed[2][2];
+  ullint			seed = 1;
+  bool				identical;
+
+  for (unsigned int idx = 0; idx < BENCH_EXEC_ACCOUNTS; idx++)
+    {
+      unsigned char	key[32];
+      char		buff[32];
+      int		len = snprintf(buff, sizeof(buff), "bench-%u", idx);
+
+      sha256((unsigned char *) buff, len, key);
+      account_create(key, 100);
+    }
+  for (unsigned int idx = 0; idx < BENCH_EXEC_NUMTX; idx++)
+    {
+      char		buff[32];
+      int		len;
+
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      len = snprintf(buff, sizeof(buff), "bench-%llu", (seed >> 33) % BENCH_EXEC_ACCOUNTS);
+      sha256((unsigned char *) buff, len, block[idx].sender);
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      len = snprintf(buff, sizeof(buff), "bench-%llu", (seed >> 33) % BENCH_EXEC_ACCOUNTS);
+      sha256((unsigned char *) buff, len, block[idx].receiver);
+      amount_store(block[idx].amount, 1 + (seed >> 40) % 100);
+      memset(block[idx].timestamp, '0', sizeof(block[idx].timestamp));
+    }
+  initial = state_current();
+
+  // Run 0 is serial, run 1 parallel
+  identical = true;
+  for (int run = 0; run < 2; run++)
+    {
+      stateref_t	state = initial;
+
+      for (int revert = 0; revert < 2; revert++)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &start);
+	  state = state_fork(state);
+	  executed[run][revert] = trans_exec_threads(*state, block.data(), BENCH_EXEC_NUMTX, revert,
+						     run ? numthreads : 1, NULL);
+	  clock_gettime(CLOCK_MONOTONIC, &end);
+	  seconds[run][revert] = bench_seconds(&start, &end);
+	  if (run == 0)
+	    serial[revert] = state;
+	  else
+	    for (uint acc = 0; acc < initial->count; acc++)
+	      if (account_balance(*serial[revert], acc) != account_balance(*state, acc))
+		identical = false;
+	}
+      identical = identical && executed[run][0] == executed[0][0] && executed[run][1] == executed[0][1];
+    }
+
+  std::cout << "BENCH:exec," << BENCH_EXEC_NUMTX << "," << numthreads << ","
+	    << executed[0][0] << "," << seconds[0][0] << "," << seconds[1][0] << ","
+	    << seconds[0][1] << "," << seconds[1][1] << "," << (identical ? "identical" : "MISMATCH")
+	    << std::endl;
+  return (identical);
+}
+
+
+// Mining microbenchmark: hashing kernels on one core, then the full mining path
+// Results go to stdout as BENCH: lines, node logs go to stderr
+int		main(int argc, char **argv)
+{
+  unsigned int	numblocks = 4;
+  double	duration = 1.0;
+  long		numcpus = sysconf(_SC_NPROCESSORS_ONLN);
+  minerconf_t	conf;
+  bool		exact;
+
+  if (argc > 1)
+    numblocks = atoi(argv[1]);
+  if (argc > 2)
+    duration = atof(argv[2]);
+  if (numblocks == 0 || duration <= 0)
+    {
+      std::cerr << "Syntax: " << argv[0] << " [blocks per run] [seconds per kernel]" << std::endl;
+      return (-1);
+    }
+  if (numcpus <= 0)
+    numcpus = 1;
+
+  UTXO_init();
+  trans_pool_init(0, 0);
+  conf.numthreads = numcpus;
+  conf.nice = 0;
+  conf.affinity = -1;
+  miner_init(conf);
+
+  worker_t&	worker = workermap[0];
+  worker.serv_sock = -1;
+  worker.serv_port = 0;
+  worker.state.added = NULL;
+  worker_zero_state(worker);
+  worker.miner = miner_register(&worker);
+
+  std::cout << "# BENCH:hash,kernel,lanes,hashes,seconds,hashes_per_sec_per_core" << std::endl;
+  for (unsigned int idx = 0; idx < sizeof(bench_kernels) / sizeof(bench_kernels[0]); idx++)
+    bench_hash(bench_kernels[idx], duration);
+
+  std::cout << "# BENCH:exec,numtx,threads,executed,serial_sec,parallel_sec,"
+	    << "serial_revert_sec,parallel_revert_sec,outcome" << std::endl;
+  // At least 4 threads so that grouping is checked on small machines too
+  exact = bench_exec(std::max(numcpus, 4L));
+
+  std::cout << "# BENCH:mine,numtxinblock,difficulty,threads,blocks,fill_sec_per_tx,"
+	    << "template_sec,hashes_per_sec,hashes_per_sec_per_core,expected_sec_per_block,"
+	    << "observed_sec_per_block" << std::endl;
+  for (unsigned int tx = 0; tx < sizeof(bench_numtx) / sizeof(bench_numtx[0]); tx++)
+    for (unsigned int diff = 0; diff < sizeof(bench_difficulty) / sizeof(bench_difficulty[0]); diff++)
+      bench_mine(&worker, bench_numtx[tx], bench_difficulty[diff], numblocks, numcpus);
+
+  // Timings are still printed, but a parallel execution that diverged fails the run
+  if (exact == false)
+    {
+      std::cerr << "Parallel block execution does not match the serial one" << std::endl;
+      return (-1);
+    }
+  return (0);
+}
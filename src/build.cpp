@@ -58,6 +58,16 @@ void		pack_bootmsg(unsigned short port, bootmsg_t *msg)
   sha256((unsigned char *) "jfv47", 5, msg->addr);
 }
 
+// Build the compact header hashed by miners from a block message and its transaction root
+void		pack_blockhash(blockmsg_t *msg, unsigned char txroot[32], blockhash_t *data)
+{
+  memcpy(data->priorhash, msg->priorhash, 32);
+  memcpy(data->height, msg->height, 32);
+  memcpy(data->mineraddr, msg->mineraddr, 32);
+  memcpy(data->txroot, txroot, 32);
+  memcpy(data->nonce, msg->nonce, 32);
+}
+
 char		*unpack_sendblock(char *buf, int len)
 {
   return (NULL);
@@ -80,10 +90,6 @@ void		worker_zero_state(worker_t& worker)
     worker.state.added = new std::list<block_t>();
   else
     worker.state.added->clear();
-  if (worker.state.dropped == NULL)
-    worker.state.dropped = new std::list<block_t>();
-  else
-    worker.state.dropped->clear();
   worker.state.recv_buff = NULL;
   worker.state.recv_sz = 0;
   worker.state.recv_off = 0;  
@@ -5,15 +5,171 @@ extern blockchain_t	chain;
 extern pthread_mutex_t  chain_lock;
 extern workermap_t	workermap;
 extern clientmap_t	clientmap;
-extern mempool_t	transpool;
-extern mempool_t	past_transpool;
-extern pthread_mutex_t  transpool_lock;
+extern unsigned int	blocktime;
+
+
+// Check that a received block hash covers its header and transactions and meets its target
+// Without retargeting the target must be the one given by -difficulty, otherwise no easier than difficulty 1
+bool		chain_verify_block(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int difficulty)
+{
+  blockhash_t	data;
+  merkle_t	tree;
+  unsigned char	txroot[32];
+  unsigned char	hash[32];
+  unsigned char	target[32];
+  unsigned char	limit[32];
+  uint		bits = be32_load(((blockwork_t *) msg.nonce)->bits);
+
+  merkle_build(tree, (transdata_t *) transdata, numtxinblock);
+  if (merkle_root(tree, numtxinblock, txroot) == false)
+    return (false);
+  pack_blockhash(&msg, txroot, &data);
+  sha256((unsigned char *) &data, sizeof(data), hash);
+  if (memcmp(hash, msg.hash, 32) != 0)
+    {
+      std::cerr << "Block hash does not match header and transactions - dropping" << std::endl;
+      return (false);
+    }
+
+  target_from_bits(bits, target);
+  target_from_bits(bits_from_difficulty(blocktime ? 1 : difficulty), limit);
+  if (memcmp(target, limit, 32) > 0)
+    {
+      std::cerr << "Block target bits " << std::hex << bits << std::dec
+		<< " are easier than allowed - dropping" << std::endl;
+      return (false);
+    }
+  if (hash_check_target(hash, target) == false)
+    {
+      std::cerr << "Block hash does not meet its target - dropping" << std::endl;
+      return (false);
+    }
+  return (true);
+}
+
+
+// Header of the block at height, from the blocks pending a sync if any, else from the chain
+// (chain lock held). Return NULL if there is none
+static blockmsg_t	*chain_find_header(ullint height, blocklist_t *pending)
+{
+  char			key[33];
+
+  snprintf(key, sizeof(key), "%032llu", height);
+  if (pending != NULL)
+    for (blocklist_t::iterator it = pending->begin(); it != pending->end(); it++)
+      if (memcmp(it->hdr.height, key, 32) == 0)
+	return (&it->hdr);
+  blockmap_t::iterator it = bmap.find(std::string(key));
+  if (it == bmap.end())
+    return (NULL);
+  return (&it->second.hdr);
+}
+
+
+// Compact bits required for a block on top of parent, or for the first block if parent is NULL
+// Every RETARGET_INTERVAL blocks the target is scaled by observed over expected time span
+// The start of the span is looked up in pending blocks then on the chain (chain lock held)
+uint		chain_bits_after(blockmsg_t *parent, int difficulty, blocklist_t *pending)
+{
+  uint		initial = bits_from_difficulty(difficulty);
+  unsigned char	target[32];
+  unsigned char	limit[32];
+
+  if (blocktime == 0 || parent == NULL)
+    return (initial);
+
+  blockwork_t	*work = (blockwork_t *) parent->nonce;
+  uint		bits = be32_load(work->bits);
+  ullint	height = strtoull(tag2str(parent->height).c_str(), NULL, 10) + 1;
+
+  if (height % RETARGET_INTERVAL != 0)
+    return (bits);
+  blockmsg_t *start = chain_find_header(height - RETARGET_INTERVAL, pending);
+  if (start == NULL)
+    return (bits);
+
+  ullint first = be64_load(((blockwork_t *) start->nonce)->time);
+  ullint last = be64_load(work->time);
+  ullint expected = (RETARGET_INTERVAL - 1) * (ullint) blocktime;
+  ullint actual = (last > first ? last - first : 0);
+  if (actual < expected / RETARGET_CLAMP)
+    actual = expected / RETARGET_CLAMP;
+  if (actual > expected * RETARGET_CLAMP)
+    actual = expected * RETARGET_CLAMP;
+  if (actual == 0)
+    actual = 1;
+
+  target_from_bits(bits, target);
+  target_scale(target, actual, expected);
+  target_from_bits(bits_from_difficulty(1), limit);
+  if (memcmp(target, limit, 32) > 0)
+    memcpy(target, limit, 32);
+
+  uint next = bits_from_target(target);
+  std::cerr << "RETARGET at height " << height << ": " << actual << " sec for "
+	    << expected << " expected, bits " << std::hex << bits << " -> " << next
+	    << std::dec << std::endl;
+  return (next);
+}
+
+
+// Compact bits required for the next block on top of the chain (chain lock held)
+uint		chain_next_bits(int difficulty)
+{
+  if (chain.empty())
+    return (chain_bits_after(NULL, difficulty, NULL));
+  return (chain_bits_after(&chain.top().hdr, difficulty, NULL));
+}
+
+
+// Check that a block sits right on top of parent with the target bits required there
+// A NULL parent stands for the first block of the chain (chain lock held)
+bool		chain_check_parent(blockmsg_t& msg, blockmsg_t *parent, int difficulty,
+				   blocklist_t *pending)
+{
+  if (parent != NULL)
+    {
+      unsigned char incheight[32];
+
+      memcpy(incheight, parent->height, 32);
+      string_integer_increment((char *) incheight, 32);
+      if (memcmp(incheight, msg.height, 32) != 0 ||
+	  memcmp(parent->hash, msg.priorhash, 32) != 0)
+	{
+	  std::cerr << "Block does not extend its expected parent - dropping" << std::endl;
+	  return (false);
+	}
+    }
+  if (be32_load(((blockwork_t *) msg.nonce)->bits) != chain_bits_after(parent, difficulty, pending))
+    {
+      std::cerr << "Block target bits differ from expected - dropping" << std::endl;
+      return (false);
+    }
+  return (true);
+}
+
+
+// Header of the block below one of ours at height, or NULL at the bottom of the chain
+static blockmsg_t	*chain_find_parent(unsigned char height[32])
+{
+  ullint		num = strtoull(tag2str(height).c_str(), NULL, 10);
+
+  if (num == 0)
+    return (NULL);
+  return (chain_find_header(num - 1, NULL));
+}
 
 
 // Store new block in chain
-bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int port)
+bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int port, int difficulty)
 {
   
+  if (chain_verify_block(msg, transdata, numtxinblock, difficulty) == false)
+    {
+      free(transdata);
+      return (false);
+    }
+
   //std::cerr << "Trying to acquire chain lock" << std::endl;
   pthread_mutex_lock(&chain_lock);
   //std::cerr << "Acquired chain lock" << std::endl;
@@ -24,7 +180,10 @@ bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, in
       
       std::cerr << "Entered chain store with msgstr = " << msgstr << std::endl;
       
-      chain_accept_block(msg, transdata, numtxinblock, port);
+      if (chain_check_parent(msg, NULL, difficulty, NULL))
+	chain_accept_block(msg, transdata, numtxinblock, port);
+      else
+	free(transdata);
     }
   else
     {
@@ -56,13 +215,21 @@ bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, in
 	  memcmp(tophdr.hash, msg.priorhash, 32) == 0)
 	{
 	  std::cerr << "Entered ACCEPT_BLOCK with chain size = " << chain.size() << std::endl;	  
-	  chain_accept_block(msg, transdata, numtxinblock, port);
+	  if (chain_check_parent(msg, &tophdr, difficulty, NULL))
+	    chain_accept_block(msg, transdata, numtxinblock, port);
+	  else
+	    free(transdata);
 	}
       
       // Kill current top and replace with new top
       else if (memcmp(msg.height, tophdr.height, 32) == 0 &&
 	  memcmp(msg.priorhash, tophdr.priorhash, 32) == 0)
-	chain_merge_simple(msg, transdata, numtxinblock, top, port);
+	{
+	  if (chain_check_parent(msg, chain_find_parent(msg.height), difficulty, NULL))
+	    chain_merge_simple(msg, transdata, numtxinblock, top, port);
+	  else
+	    free(transdata);
+	}
 
       // Disagree on ancestry, nuke top blocks until common ancestry found
       else if (memcmp(tophdr.height, msg.height, 32) == 0 &&
@@ -79,9 +246,13 @@ bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, in
 	  chain_merge_deep(msg, transdata, numtxinblock, top, port);
 	}
 
-      // New block look old - propagate only 
+      // New block look old - propagate only if it was a valid block on top of our chain
       else if (smaller_than(msg.height, tophdr.height))
-	chain_propagate_only(msg, transdata, numtxinblock, port);
+	{
+	  if (chain_check_parent(msg, chain_find_parent(msg.height), difficulty, NULL))
+	    chain_propagate_only(msg, transdata, numtxinblock, port);
+	  free(transdata);
+	}
 
       else
 	std::cerr << "Unknown case of chain merge! \n" << std::endl;
@@ -97,6 +268,19 @@ bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, in
 }
 
 
+// Give up a chain sync: drop the blocks received, the chain was left as it was
+static bool	chain_sync_abort(worker_t *worker)
+{
+  std::cerr << "Chain sync failed - keeping the current chain" << std::endl;
+  if (worker->state.added != NULL)
+    for (blocklist_t::iterator it = worker->state.added->begin(); it != worker->state.added->end(); it++)
+      free(it->trans);
+  free(worker->state.recv_buff);
+  worker_zero_state(*worker);
+  return (false);
+}
+
+
 // Obtain a block hash from one of the peers
 bool		worker_send_gethash(worker_t& worker, unsigned char next_height[32])
 {
@@ -164,55 +348,46 @@ bool			chain_gethash(worker_t *worker, int sock,
   if (len != 32)
     {
       std::cerr << "ERR: Hash syncing failed in read" << std::endl;
-      return (false);
+      return (chain_sync_abort(worker));
     }
 
   // We had an answer but the hash differed from what expected
-  //block_t top = chain.top();
-  block_t blk;
-  std::string hstr = tag2str(worker->state.working_height);
-  if (bmap.find(hstr) != bmap.end())
-  {
-    blk = bmap[hstr];
-  }
-  else
+  // Our blocks stay on the chain until the whole branch is received
+  bool		differ;
+  std::string	hstr = tag2str(worker->state.working_height);
+  pthread_mutex_lock(&chain_lock);
+  blockmap_t::iterator blk = bmap.find(hstr);
+  if (blk == bmap.end())
     {
+      pthread_mutex_unlock(&chain_lock);
       std::cerr << "ERR: Unable to find unblock at working height " << hstr << std::endl;
-      return (false);
+      return (chain_sync_abort(worker));
     }
+  differ = (memcmp(found_hash, blk->second.hdr.hash, 32) != 0);
+  if (differ)
+    std::cerr << "WARN: get_hash: Hash differed: received " << hash2str(found_hash)
+	      << " vs top: " << hash2str(blk->second.hdr.hash) << std::endl;
+  pthread_mutex_unlock(&chain_lock);
 
-  if (memcmp(found_hash, blk.hdr.hash, 32) != 0)
+  if (differ)
     {
-      std::cerr << "WARN: get_hash: Hash differed: received " << hash2str(found_hash)
-		<< " vs top: " << hash2str(blk.hdr.hash) << std::endl;
-      
-      chain.pop();
-      if (worker->state.dropped == NULL)
-	worker->state.dropped = new std::list<block_t>();
-      worker->state.dropped->push_front(blk);
-      bmap.erase(tag2str(blk.hdr.height));
-      
-      if (chain.size() == 0)
+      if (strspn((char *) worker->state.working_height, "0") == 32)
 	{
-	  std::cerr << "WARN: get_hash: Hash differed and reached empty chain" << std::endl;
+	  std::cerr << "WARN: get_hash: Hash differed down to the first block" << std::endl;
 	  return (worker_send_getblock(*worker, sock));
 	}
-      else
-	{
-	  std::cerr << "FOUND CHAIN SIZE = " << chain.size() << std::endl;
-	  string_integer_decrement((char *) worker->state.working_height, 32);
-	  std::cerr << "WARN: get_hash: Hash differed, asking deeper hash at height "
-		    << tag2str(worker->state.working_height) << std::endl;
-	  return (worker_send_gethash(*worker, worker->state.working_height));
-	}
-      
+      string_integer_decrement((char *) worker->state.working_height, 32);
+      std::cerr << "WARN: get_hash: Hash differed, asking deeper hash at height "
+		<< tag2str(worker->state.working_height) << std::endl;
+      return (worker_send_gethash(*worker, worker->state.working_height));
     }
 
   // We received an answer with the same hash as the expected
   std::cerr << "chain_gethash: Found ancestor block with MATCHING hash (height "
 	    << tag2str(worker->state.working_height) << ") NOW SEND GETBLOCK" << std::endl;
 
-  // Now start getting block data starting with the bottom hash
+  // Now start getting block data right above the common ancestor, which is still on our chain
+  string_integer_increment((char *) worker->state.working_height, 32);
   return (worker_send_getblock(*worker, sock));
 }
 
@@ -229,15 +404,13 @@ bool		chain_getblock(worker_t *worker, int sock,
   if (len != 1)
     {
       std::cerr << "Block syncing failed in read 1" << std::endl;
-      // XXX: should restore all dropped block here
-      return (false);
+      return (chain_sync_abort(worker));
     }
   len = async_read(sock, (char *) &hdr, sizeof(hdr), 0);
   if (len != sizeof(hdr))
     {
       std::cerr << "Block syncing failed in read 2" << std::endl;
-      // XXX: should restore all dropped block here
-      return (false);
+      return (chain_sync_abort(worker));
     }
   int total = numtxinblock * 128;
   if (worker->state.recv_buff == NULL)
@@ -246,8 +419,7 @@ bool		chain_getblock(worker_t *worker, int sock,
       if (worker->state.recv_buff == NULL)
 	{
 	  std::cerr << "chain_getblock malloc failure" << std::endl;
-	  // XXX: should restore all dropped block here
-	  return (false);
+	  return (chain_sync_abort(worker));
 	}
       worker->state.recv_sz = total;
       worker->state.recv_off = 0;
@@ -257,8 +429,7 @@ bool		chain_getblock(worker_t *worker, int sock,
   if (len < 0)
     {
       std::cerr << "chain_getblock: async_read failed " << len << " vs " << toread << std::endl;
-      // XXX: should restore all dropped block here
-      return (false);
+      return (chain_sync_abort(worker));
     }
   if (len != toread)
     {
@@ -266,19 +437,76 @@ bool		chain_getblock(worker_t *worker, int sock,
       return (true);
     }
 
+  // A valid block broadcast by the peer can come in before the answer: it is not the one requested
+  bool valid = (opcode == OPCODE_SENDBLOCK &&
+		chain_verify_block(hdr, worker->state.recv_buff, numtxinblock, difficulty));
+  if (valid && memcmp(hdr.height, worker->state.working_height, sizeof(hdr.height)) != 0)
+    {
+      std::cerr << "chain_getblock: received block at height " << tag2str(hdr.height)
+		<< " while waiting for " << tag2str(worker->state.working_height) << " - ignoring" << std::endl;
+      worker->state.recv_off = 0;
+      return (true);
+    }
+
   block.hdr = hdr;
   block.trans = (transdata_t *) worker->state.recv_buff;
-
   if (worker->state.added == NULL)
     worker->state.added = new std::list<block_t>();
+
+  // The block must extend the previous one received, or the common ancestor for the first one
+  pthread_mutex_lock(&chain_lock);
+  blockmsg_t *parent = NULL;
+  if (worker->state.added->empty() == false)
+    parent = &worker->state.added->back().hdr;
+  else
+    parent = chain_find_parent(hdr.height);
+  valid = valid && chain_check_parent(hdr, parent, difficulty, worker->state.added);
+  pthread_mutex_unlock(&chain_lock);
+  if (valid == false)
+    {
+      std::cerr << "chain_getblock: received block failed verification" << std::endl;
+      return (chain_sync_abort(worker));
+    }
+
+  // The block owns its buffer now, the next one is read into a new buffer
   worker->state.added->push_back(block);
+  worker->state.recv_buff = NULL;
+  worker->state.recv_sz = 0;
+  worker->state.recv_off = 0;
 
-  // If we are done, sync transactions
+  // If we are done, switch to the branch in one step under the chain lock, so that the miner
+  // and received blocks never see the chain and the accounts apart. Our blocks above the
+  // common ancestor leave the chain, including those mined during the sync
   if (memcmp(hdr.height, worker->state.expected_height, sizeof(hdr.height)) == 0)
     {
+      blocklist_t	removed;
+      blockmsg_t	*first = &worker->state.added->front().hdr;
+
       std::cerr << "chain_getblock: Detected expected_height " << tag2str(hdr.height) << " syncing and returning OK" << std::endl;
-      trans_sync(*worker->state.added, *worker->state.dropped, numtxinblock, true);
+      pthread_mutex_lock(&chain_lock);
+      while (chain.empty() == false && smaller_than(chain.top().hdr.height, first->height) == false)
+	{
+	  removed.push_front(chain.top());
+	  bmap.erase(tag2str(chain.top().hdr.height));
+	  chain.pop();
+	}
+      miner_abort(*worker->miner, numtxinblock);
+      if (chain_check_parent(*first, chain.empty() ? NULL : &chain.top().hdr, difficulty, NULL) == false ||
+	  trans_sync(*worker->state.added, removed, numtxinblock, true) != 0)
+	{
+	  for (blocklist_t::iterator it = removed.begin(); it != removed.end(); it++)
+	    {
+	      chain.push(*it);
+	      bmap[tag2str(it->hdr.height)] = *it;
+	    }
+	  pthread_mutex_unlock(&chain_lock);
+	  return (chain_sync_abort(worker));
+	}
+      pthread_mutex_unlock(&chain_lock);
       worker_zero_state(*worker);
+
+      // Transactions of the removed blocks are back in the pool, an idle miner has work again
+      miner_wake(worker, difficulty, numtxinblock);
       return (true);
     }
   else
@@ -313,20 +541,16 @@ bool			chain_sync(worker_t& worker, unsigned char expected_height[32])
 
   memcpy(worker.state.expected_height, expected_height, 32);
     
-  // We start to search from the minimal height from chain and new block
-  if (chain.size() == 0)
-    memset(worker.state.working_height, '0', 32); 
-  else
+  // We start to search from the block below our top, down to the first block
+  // A chain of one block or none has no ancestor to look for: the branch is fetched whole
+  if (chain.size() <= 1)
     {
-      block_t	top = chain.top();
-      memcpy(worker.state.working_height, top.hdr.height, 32);
-      string_integer_decrement((char *) worker.state.working_height, 32);
-      if (worker.state.dropped == NULL)
-	worker.state.dropped = new std::list<block_t>();
-      worker.state.dropped->push_front(top);
-      bmap.erase(tag2str(top.hdr.height));
-      chain.pop();
+      memset(worker.state.working_height, '0', 32);
+      std::cerr << "chain_sync: sending new GETBLOCK command" << std::endl;
+      return (worker_send_getblock(worker, 0));
     }
+  memcpy(worker.state.working_height, chain.top().hdr.height, 32);
+  string_integer_decrement((char *) worker.state.working_height, 32);
 
   std::cerr << "chain_sync: sending new GETHASH command" << std::endl;
   
@@ -339,43 +563,25 @@ bool		chain_accept_block(blockmsg_t msg, char *transdata,
 				   unsigned int numtxinblock, int port)
 {
   block_t	newtop;
-  miner_t&	miner = workermap[port].miner;
+  miner_t&	miner = *workermap[port].miner;
   blocklist_t	synced;
   blocklist_t	removed;
   blocklistpair_t bp;
 
   std::cerr << "Entered chain accept block" << std::endl;
   
-  // Kill any existing miner and push new block on chain
-  if (miner.tid)
-    {
-      std::cout << "Killing miner tid = " << miner.tid << std::endl;
-      
-      pthread_kill(miner.tid, SIGTERM);
-      miner.tid = 0;
-      
-      pthread_mutex_lock(&transpool_lock);
-      transpool.insert(miner.pending.begin(), miner.pending.end());
-      pthread_mutex_unlock(&transpool_lock);
-      
-      miner.pending.clear();
-      std::cerr << "Accepted block on the chain - killed miner tid "
-		<< miner.tid << " on the way " << std::endl;
-      thread_create();
-    }
-  else
-    {
-      std::cerr << "Accepted block on the chain - no miner was currently running" << std::endl;
-    }
+  // Stop any running round and push new block on chain
+  miner_abort(miner, numtxinblock);
 
   newtop.hdr = msg;
   newtop.trans = (transdata_t *) transdata;
-  chain.push(newtop);
-  std::string height = tag2str(newtop.hdr.height);
-  bmap[height] = newtop;
   synced.push_back(newtop);
   bp = std::make_pair(synced, removed);
-  trans_sync(bp.first, bp.second, numtxinblock, false);
+  if (trans_sync(bp.first, bp.second, numtxinblock, true) != 0)
+    {
+      free(transdata);
+      return (false);
+    }
   return (true);
 }
 
@@ -385,7 +591,7 @@ bool		chain_merge_simple(blockmsg_t msg, char *transdata,
 				   unsigned int numtxinblock, block_t& top, int port)
 {
   block_t	newtop;
-  miner_t&	miner = workermap[port].miner;
+  miner_t&	miner = *workermap[port].miner;
 
   std::cerr << "ENTERED chain merge simple" << std::endl;
   
@@ -396,49 +602,25 @@ bool		chain_merge_simple(blockmsg_t msg, char *transdata,
   std::string height = tag2str(oldtop.hdr.height);
   bmap.erase(height);
   
-  // Kill any existing miner and push new block on chain
-  if (miner.tid)
-    {
+  // Stop any running round and push new block on chain
+  miner_abort(miner, numtxinblock);
 
-      std::cout << "Killing miner tid = " << miner.tid << std::endl;
-      
-      pthread_kill(miner.tid, SIGTERM);
-      miner.tid = 0;
-      
-      pthread_mutex_lock(&transpool_lock);
-      transpool.insert(miner.pending.begin(), miner.pending.end());
-      pthread_mutex_unlock(&transpool_lock);
-      
-      miner.pending.clear();
-      thread_create();
-      
-      newtop.hdr = msg;
-      newtop.trans = (transdata_t *) transdata;
-      
-      chain.push(newtop);
-      std::string height = tag2str(newtop.hdr.height);
-      bmap[height] = newtop;
-      
-      std::cerr << "Accepted block on the chain - killed miner tid "
-		<< miner.tid << " on the way " << std::endl;
-    }
-  else
-    {
-      newtop.hdr = msg;
-      newtop.trans = (transdata_t *) transdata;
-      chain.push(newtop);
-      std::string height = tag2str(newtop.hdr.height);
-      bmap[height] = newtop;
-      
-      std::cerr << "Accepted block on the chain - no miner was currently running" << std::endl;
-    }
+  newtop.hdr = msg;
+  newtop.trans = (transdata_t *) transdata;
 
   // Sync the transaction pool and account to reflect the new state of the chain
+  // The new block is pushed on chain only if it applies, otherwise the old top comes back
   blocklist_t removed;
   blocklist_t added;
   added.push_back(newtop);
   removed.push_back(top);
-  trans_sync(added, removed, numtxinblock, false);
+  if (trans_sync(added, removed, numtxinblock, true) != 0)
+    {
+      chain.push(oldtop);
+      bmap[height] = oldtop;
+      free(transdata);
+      return (false);
+    }
   return (true);
 }
 
@@ -448,23 +630,12 @@ bool			chain_merge_deep(blockmsg_t msg, char *transdata,
 					 unsigned int numtxinblock, block_t& top, int port)
 {
   worker_t&		worker = workermap[port];
-  miner_t&		miner = worker.miner;
+  miner_t&		miner = *worker.miner;
 
   std::cerr << "ENTERED chain merge deep" << std::endl;
   
-  if (miner.tid)
-    {
-      std::cerr << "Killing miner tid = " << miner.tid << std::endl;
-      
-      pthread_kill(miner.tid, SIGTERM);
-      miner.tid = 0;
-      pthread_mutex_lock(&transpool_lock);
-      transpool.insert(miner.pending.begin(), miner.pending.end());
-      miner.pending.clear();
-      pthread_mutex_unlock(&transpool_lock);
-      thread_create();
-    }
-  
+  // Stop any running round, its block would not extend the chain we sync to
+  miner_abort(miner, numtxinblock);
 
   // There is no common ancestor - sync up with chain of sent block entirely
   bool ret = chain_sync(worker, msg.height);
@@ -497,22 +668,17 @@ bool	chain_propagate_only(blockmsg_t msg, char *transdata,
     {
       transdata_t *curdata = ((transdata_t *) transdata) + idx;
       
-      std::string transkey = hash_binary_to_string(curdata->sender) +
-	hash_binary_to_string(curdata->receiver) +
-	hash_binary_to_string(curdata->amount) +
-	hash_binary_to_string(curdata->timestamp);
-      
-      if (past_transpool.find(transkey) == past_transpool.end())
+      if (trans_pool_past(curdata) == false)
 	continue;
       
       for (clientmap_t::iterator it = clientmap.begin(); it != clientmap.end(); it++)
 	{
 	  remote_t remote = it->second;
 
-	  char opcode = OPCODE_SENDTRANS;
-	  async_send(remote.client_sock, &opcode, 1, "Propagate opcode on remote", false);
-	  async_send(remote.client_sock, (char *) curdata,
-		     sizeof(transdata_t), "Propagate transaction on remote", false);
+	  char msg[1 + sizeof(transdata_t)];
+	  msg[0] = OPCODE_SENDTRANS;
+	  memcpy(msg + 1, curdata, sizeof(transdata_t));
+	  async_send(remote.client_sock, msg, sizeof(msg), "Propagate transaction on remote", false);
 	  
 	  //std::cerr << "Propagated trans to remote port " << remote.remote_port << std::endl;
 	}
@@ -18,3 +18,154 @@ void		sha256_mineraddr(unsigned char *output)
 {
   sha256((unsigned char *) "jfv47", 5, output);
 }
+
+// Hash the constant prefix of a message once, to be completed many times later
+// The raw state only absorbs whole 64 bytes blocks, the rest of the prefix is kept aside
+void		sha256_midstate(unsigned char *prefix, unsigned int len, hashmid_t *midstate)
+{
+  unsigned int	off;
+
+  sha256_init_state(midstate->state);
+  for (off = 0; off + 64 <= len; off += 64)
+    sha256_compress(midstate->state, prefix + off);
+  midstate->len = len;
+  midstate->restlen = len - off;
+  memcpy(midstate->rest, prefix + off, midstate->restlen);
+  midstate->bits = (len + 32) * 8;
+}
+
+// Complete a midstate with the variable tail of the message
+void		sha256_finish(hashmid_t *midstate, unsigned char *tail, unsigned int len,
+			      unsigned char *output)
+{
+  unsigned int	state[8];
+  unsigned char	block[64];
+  unsigned int	fill = midstate->restlen;
+  ullint	bits = ((ullint) midstate->len + len) * 8;
+
+  memcpy(state, midstate->state, sizeof(state));
+  memcpy(block, midstate->rest, fill);
+  while (len > 0)
+    {
+      unsigned int chunk = (len < 64 - fill ? len : 64 - fill);
+      memcpy(block + fill, tail, chunk);
+      fill += chunk;
+      tail += chunk;
+      len -= chunk;
+      if (fill == 64)
+	{
+	  sha256_compress(state, block);
+	  fill = 0;
+	}
+    }
+
+  // Padding bit, then the message length in bits on the last 8 bytes
+  block[fill++] = 0x80;
+  if (fill > 56)
+    {
+      memset(block + fill, 0x00, 64 - fill);
+      sha256_compress(state, block);
+      fill = 0;
+    }
+  memset(block + fill, 0x00, 56 - fill);
+  be64_store(block + 56, bits);
+  sha256_compress(state, block);
+  for (int idx = 0; idx < 8; idx++)
+    be32_store(output + idx * 4, state[idx]);
+}
+
+// Check that a block hash, read as a big endian integer, is not above the target
+bool		hash_check_target(unsigned char hash[32], unsigned char target[32])
+{
+  return (memcmp(hash, target, 32) <= 0);
+}
+
+
+// Expand compact bits into a 256-bit big endian target
+// The high byte is the size of the target in bytes, the low 23 bits its leading digits
+void		target_from_bits(uint bits, unsigned char target[32])
+{
+  int		exponent = bits >> 24;
+  uint		mantissa = bits & 0x007FFFFF;
+
+  memset(target, 0x00, 32);
+  for (int idx = 0; idx < 3; idx++)
+    {
+      int pos = 32 - exponent + idx;
+      if (pos >= 0 && pos < 32)
+	target[pos] = (mantissa >> (8 * (2 - idx))) & 0xFF;
+    }
+}
+
+
+// Encode a target into compact bits, truncated to its three leading bytes
+uint		bits_from_target(unsigned char target[32])
+{
+  int		first = 0;
+  uint		mantissa = 0;
+
+  while (first < 32 && target[first] == 0)
+    first++;
+  if (first == 32)
+    return (0);
+  for (int idx = 0; idx < 3; idx++)
+    mantissa = (mantissa << 8) | (first + idx < 32 ? target[first + idx] : 0);
+
+  // The mantissa high bit is reserved - keep it clear by moving one byte up
+  int exponent = 32 - first;
+  if (mantissa & 0x00800000)
+    {
+      mantissa >>= 8;
+      exponent++;
+    }
+  return ((exponent << 24) | mantissa);
+}
+
+
+// Compact bits of the target where a hash needs difficulty leading zero bytes
+uint		bits_from_difficulty(int difficulty)
+{
+  unsigned char	target[32];
+
+  if (difficulty < 0)
+    difficulty = 0;
+  if (difficulty > 31)
+    difficulty = 31;
+  memset(target, 0x00, difficulty);
+  memset(target + difficulty, 0xFF, 32 - difficulty);
+  return (bits_from_target(target));
+}
+
+
+// Multiply a target by mul / div, saturating at the largest 256-bit value
+// The product is kept on 288 bits so that scaling up then down does not overflow
+void		target_scale(unsigned char target[32], ullint mul, ullint div)
+{
+  unsigned int		words[9];
+  unsigned __int128	carry = 0;
+  int			idx;
+
+  words[0] = 0;
+  for (idx = 0; idx < 8; idx++)
+    words[idx + 1] = be32_load(target + idx * 4);
+  for (idx = 8; idx >= 0; idx--)
+    {
+      unsigned __int128 cur = (unsigned __int128) words[idx] * mul + carry;
+      words[idx] = (unsigned int) cur;
+      carry = cur >> 32;
+    }
+  carry = 0;
+  for (idx = 0; idx < 9; idx++)
+    {
+      unsigned __int128 cur = (carry << 32) | words[idx];
+      words[idx] = (unsigned int) (cur / div);
+      carry = cur % div;
+    }
+  if (words[0] != 0)
+    {
+      memset(target, 0xFF, 32);
+      return;
+    }
+  for (idx = 0; idx < 8; idx++)
+    be32_store(target + idx * 4, words[idx + 1]);
+}
@@ -0,0 +1,188 @@
+#include "node.h"
+
+extern mempoolshard_t	transshards[MEMPOOL_SHARDS];
+
+// Mempool journal: append-only file of 128 bytes transdata_t records
+// Records are buffered and written by the select loop, the file is rewritten from the pool
+// once it holds more than twice the pool. The journal lock is never taken with a shard lock held
+static pthread_mutex_t	journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::string	journal_path;
+static int		journal_fd = -1;
+static std::string	journal_buff;
+static ullint		journal_start = 0;
+static ullint		journal_records = 0;
+
+
+// Microseconds on the monotonic clock
+static ullint	journal_now()
+{
+  struct timespec	now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+
+// Write all of buff to fd. Return false on error
+static bool	journal_write(int fd, const char *buff, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t written = write(fd, buff, len);
+      if (written < 0 && errno == EINTR)
+	continue;
+      if (written <= 0)
+	return (false);
+      buff += written;
+      len -= written;
+    }
+  return (true);
+}
+
+
+// Queue accepted transactions for the journal
+void		journal_append(transdata_t *data, unsigned int count)
+{
+  bool		full;
+
+  pthread_mutex_lock(&journal_lock);
+  if (journal_fd < 0)
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return;
+    }
+  if (journal_buff.empty())
+    journal_start = journal_now();
+  journal_buff.append((char *) data, count * sizeof(transdata_t));
+  full = (journal_buff.size() >= JOURNAL_BUFF_MAX);
+  pthread_mutex_unlock(&journal_lock);
+  if (full)
+    journal_flush(true);
+}
+
+
+// Write queued records to the journal
+// Without force, nothing is written until the oldest record waited JOURNAL_FLUSH_USEC
+void		journal_flush(bool force)
+{
+  pthread_mutex_lock(&journal_lock);
+  if (journal_fd < 0 || journal_buff.empty() ||
+      (force == false && journal_now() - journal_start < JOURNAL_FLUSH_USEC))
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return;
+    }
+  if (journal_write(journal_fd, journal_buff.data(), journal_buff.size()) == false)
+    perror("Mempool journal write failed");
+  journal_records += journal_buff.size() / sizeof(transdata_t);
+  journal_buff.clear();
+  pthread_mutex_unlock(&journal_lock);
+}
+
+
+// Rewrite the journal from the transactions waiting in the pool or in miner templates
+// The pool is copied under the shard locks, the file is written after releasing them
+// Without force, this only happens when the journal holds more than twice the pool
+void		journal_compact(bool force)
+{
+  std::string	snapshot;
+  ullint	count = 0;
+
+  pthread_mutex_lock(&journal_lock);
+  if (journal_path.empty())
+    {
+      pthread_mutex_unlock(&journal_lock);
+      return;
+    }
+  trans_pool_lockall();
+  for (unsigned int idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    count += transshards[idx].pool.count + transshards[idx].taken.count;
+  if (force == false &&
+      journal_records + journal_buff.size() / sizeof(transdata_t) <= 2 * count + JOURNAL_MIN_RECORDS)
+    {
+      trans_pool_unlockall();
+      pthread_mutex_unlock(&journal_lock);
+      return;
+    }
+  snapshot.reserve(count * sizeof(transdata_t));
+  for (unsigned int idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    {
+      mempool_t	*tables[2] = { &transshards[idx].pool, &transshards[idx].taken };
+
+      for (unsigned int tab = 0; tab < 2; tab++)
+	for (ullint slot = 0; slot < tables[tab]->slots.size(); slot++)
+	  if (tables[tab]->slots[slot].hash != 0)
+	    snapshot.append((char *) &tables[tab]->slots[slot].msg.data, sizeof(transdata_t));
+    }
+  trans_pool_unlockall();
+
+  // Queued records are all in the snapshot
+  journal_buff.clear();
+  std::string tmppath = journal_path + ".tmp";
+  int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || journal_write(fd, snapshot.data(), snapshot.size()) == false ||
+      rename(tmppath.c_str(), journal_path.c_str()) < 0)
+    {
+      perror("Mempool journal compaction failed");
+      if (fd >= 0)
+	close(fd);
+      pthread_mutex_unlock(&journal_lock);
+      return;
+    }
+  if (journal_fd >= 0)
+    close(journal_fd);
+  journal_fd = fd;
+  journal_records = count;
+  pthread_mutex_unlock(&journal_lock);
+  std::cerr << "Mempool journal compacted to " << count << " transactions" << std::endl;
+}
+
+
+// Reload the transactions of the journal at path into the pool, then keep journaling there
+// Records are mapped and go through the same bulk verification as SENDTRANSBATCH messages,
+// against the accounts of this node. Return the number of transactions admitted
+ullint		journal_load(const char *path, worker_t *worker, unsigned int numtxinblock,
+			     int difficulty)
+{
+  struct timespec	start;
+  struct timespec	end;
+  struct stat		st;
+  ullint		total = 0;
+  ullint		loaded = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&journal_lock);
+  journal_path = path;
+  pthread_mutex_unlock(&journal_lock);
+
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(transdata_t))
+    {
+      total = st.st_size / sizeof(transdata_t);
+      void *map = mmap(NULL, total * sizeof(transdata_t), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+	{
+	  perror("Mempool journal mmap failed");
+	  total = 0;
+	}
+      else
+	{
+	  madvise(map, total * sizeof(transdata_t), MADV_SEQUENTIAL);
+	  for (ullint off = 0; off < total; off += TRANS_BATCH_MAX)
+	    loaded += trans_verify_batch(worker, -1, (transdata_t *) map + off,
+					 std::min(total - off, (ullint) TRANS_BATCH_MAX),
+					 numtxinblock, difficulty);
+	  munmap(map, total * sizeof(transdata_t));
+	}
+    }
+  if (fd >= 0)
+    close(fd);
+
+  // Start over with a journal holding exactly the pool
+  journal_compact(true);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  std::cerr << "Mempool journal " << path << ": reloaded " << loaded
+	    << " of " << total << " transactions in "
+	    << (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9 << " sec" << std::endl;
+  return (loaded);
+}
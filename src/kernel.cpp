@@ -0,0 +1,380 @@
+#include "node.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASHKERN_X86
+#endif
+
+// SHA-256 constants
+static const unsigned int sha256_k[64] =
+  {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+  };
+
+static const unsigned int sha256_iv[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+// Round functions - these work on scalars and on GCC vector types alike
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define BSIG0(x)	(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x)	(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x)	(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)	(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+#define CH(e, f, g)	(((e) & (f)) ^ (~(e) & (g)))
+#define MAJ(a, b, c)	(((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)))
+
+static inline unsigned int	load_be32(unsigned char *buff)
+{
+  return (((unsigned int) buff[0] << 24) | ((unsigned int) buff[1] << 16) |
+	  ((unsigned int) buff[2] << 8) | (unsigned int) buff[3]);
+}
+
+static inline void		store_be32(unsigned char *buff, unsigned int val)
+{
+  buff[0] = val >> 24;
+  buff[1] = val >> 16;
+  buff[2] = val >> 8;
+  buff[3] = val;
+}
+
+
+// Initialize a raw SHA-256 state
+void		sha256_init_state(unsigned int state[8])
+{
+  memcpy(state, sha256_iv, sizeof(sha256_iv));
+}
+
+
+// Scalar SHA-256 compression of one 64 bytes block
+void		sha256_compress(unsigned int state[8], unsigned char block[64])
+{
+  unsigned int	w[64];
+  unsigned int	a, b, c, d, e, f, g, h, t1, t2;
+  int		idx;
+
+  for (idx = 0; idx < 16; idx++)
+    w[idx] = load_be32(block + idx * 4);
+  for (idx = 16; idx < 64; idx++)
+    w[idx] = SSIG1(w[idx - 2]) + w[idx - 7] + SSIG0(w[idx - 15]) + w[idx - 16];
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+  e = state[4]; f = state[5]; g = state[6]; h = state[7];
+  for (idx = 0; idx < 64; idx++)
+    {
+      t1 = h + BSIG1(e) + CH(e, f, g) + sha256_k[idx] + w[idx];
+      t2 = BSIG0(a) + MAJ(a, b, c);
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+
+// Reference kernel: scalar compression on top of the midstate, one nonce per call
+static void	hashkern_scalar(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  sha256_finish(mid, nonces[0], 32, hashes[0]);
+}
+
+static bool	hashkern_always()
+{
+  return (true);
+}
+
+
+#ifdef HASHKERN_X86
+
+// Multi-buffer kernel: each lane of V finishes the midstate with its own nonce
+// The last block is the 32 bytes nonce, the padding bit and the message length
+template <typename V>
+static inline __attribute__((always_inline))
+void		sha256_lanes(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  const unsigned int	lanes = sizeof(V) / sizeof(unsigned int);
+  V			w[64];
+  V			zero = {};
+  V			a, b, c, d, e, f, g, h, t1, t2;
+  unsigned int		idx;
+  unsigned int		lane;
+
+  for (idx = 0; idx < 8; idx++)
+    for (lane = 0; lane < lanes; lane++)
+      w[idx][lane] = load_be32(nonces[lane] + idx * 4);
+  w[8] = zero + 0x80000000U;
+  for (idx = 9; idx < 15; idx++)
+    w[idx] = zero;
+  w[15] = zero + mid->bits;
+  for (idx = 16; idx < 64; idx++)
+    w[idx] = SSIG1(w[idx - 2]) + w[idx - 7] + SSIG0(w[idx - 15]) + w[idx - 16];
+
+  a = zero + mid->state[0]; b = zero + mid->state[1];
+  c = zero + mid->state[2]; d = zero + mid->state[3];
+  e = zero + mid->state[4]; f = zero + mid->state[5];
+  g = zero + mid->state[6]; h = zero + mid->state[7];
+  for (idx = 0; idx < 64; idx++)
+    {
+      t1 = h + BSIG1(e) + CH(e, f, g) + sha256_k[idx] + w[idx];
+      t2 = BSIG0(a) + MAJ(a, b, c);
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+  a += mid->state[0]; b += mid->state[1]; c += mid->state[2]; d += mid->state[3];
+  e += mid->state[4]; f += mid->state[5]; g += mid->state[6]; h += mid->state[7];
+
+  for (lane = 0; lane < lanes; lane++)
+    {
+      store_be32(hashes[lane] +  0, a[lane]);
+      store_be32(hashes[lane] +  4, b[lane]);
+      store_be32(hashes[lane] +  8, c[lane]);
+      store_be32(hashes[lane] + 12, d[lane]);
+      store_be32(hashes[lane] + 16, e[lane]);
+      store_be32(hashes[lane] + 20, f[lane]);
+      store_be32(hashes[lane] + 24, g[lane]);
+      store_be32(hashes[lane] + 28, h[lane]);
+    }
+}
+
+typedef unsigned int	v4u_t __attribute__((vector_size(16)));
+typedef unsigned int	v8u_t __attribute__((vector_size(32)));
+typedef unsigned int	v16u_t __attribute__((vector_size(64)));
+
+static void __attribute__((target("sse4.1")))
+hashkern_sse4(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  sha256_lanes<v4u_t>(mid, nonces, hashes);
+}
+
+static void __attribute__((target("avx2")))
+hashkern_avx2(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  sha256_lanes<v8u_t>(mid, nonces, hashes);
+}
+
+static void __attribute__((target("avx512f")))
+hashkern_avx512(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  sha256_lanes<v16u_t>(mid, nonces, hashes);
+}
+
+
+// SHA extensions kernel: each compression runs in hardware
+// Two nonces are interleaved to hide the latency of the round instructions
+static void __attribute__((target("sha,sse4.1")))
+sha256_shani_two(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  unsigned char	block[64];
+  __m128i	state0[2], state1[2], msg[2], tmp[2], m[2][4];
+  __m128i	save0, save1;
+  const __m128i	mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  int		grp;
+  int		str;
+
+  memset(block, 0x00, sizeof(block));
+  block[32] = 0x80;
+  store_be32(block + 60, mid->bits);
+
+  // Rearrange state words into ABEF / CDGH as the SHA instructions expect
+  tmp[0] = _mm_loadu_si128((__m128i *) &mid->state[0]);
+  save1 = _mm_loadu_si128((__m128i *) &mid->state[4]);
+  tmp[0] = _mm_shuffle_epi32(tmp[0], 0xB1);
+  save1 = _mm_shuffle_epi32(save1, 0x1B);
+  save0 = _mm_alignr_epi8(tmp[0], save1, 8);
+  save1 = _mm_blend_epi16(save1, tmp[0], 0xF0);
+
+  for (str = 0; str < 2; str++)
+    {
+      state0[str] = save0;
+      state1[str] = save1;
+      m[str][0] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) nonces[str]), mask);
+      m[str][1] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (nonces[str] + 16)), mask);
+      m[str][2] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (block + 32)), mask);
+      m[str][3] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *) (block + 48)), mask);
+    }
+
+  for (grp = 0; grp < 16; grp++)
+    for (str = 0; str < 2; str++)
+      {
+	msg[str] = _mm_add_epi32(m[str][grp % 4], _mm_loadu_si128((__m128i *) &sha256_k[grp * 4]));
+	state1[str] = _mm_sha256rnds2_epu32(state1[str], state0[str], msg[str]);
+	if (grp >= 3 && grp <= 14)
+	  {
+	    tmp[str] = _mm_alignr_epi8(m[str][grp % 4], m[str][(grp + 3) % 4], 4);
+	    m[str][(grp + 1) % 4] = _mm_add_epi32(m[str][(grp + 1) % 4], tmp[str]);
+	    m[str][(grp + 1) % 4] = _mm_sha256msg2_epu32(m[str][(grp + 1) % 4], m[str][grp % 4]);
+	  }
+	msg[str] = _mm_shuffle_epi32(msg[str], 0x0E);
+	state0[str] = _mm_sha256rnds2_epu32(state0[str], state1[str], msg[str]);
+	if (grp >= 1 && grp <= 12)
+	  m[str][(grp + 3) % 4] = _mm_sha256msg1_epu32(m[str][(grp + 3) % 4], m[str][grp % 4]);
+      }
+
+  // Back to ABCD / EFGH then big endian output
+  for (str = 0; str < 2; str++)
+    {
+      state0[str] = _mm_add_epi32(state0[str], save0);
+      state1[str] = _mm_add_epi32(state1[str], save1);
+      tmp[str] = _mm_shuffle_epi32(state0[str], 0x1B);
+      state1[str] = _mm_shuffle_epi32(state1[str], 0xB1);
+      state0[str] = _mm_blend_epi16(tmp[str], state1[str], 0xF0);
+      state1[str] = _mm_alignr_epi8(state1[str], tmp[str], 8);
+      _mm_storeu_si128((__m128i *) hashes[str], _mm_shuffle_epi8(state0[str], mask));
+      _mm_storeu_si128((__m128i *) (hashes[str] + 16), _mm_shuffle_epi8(state1[str], mask));
+    }
+}
+
+static void	hashkern_shani(hashmid_t *mid, unsigned char (*nonces)[32], unsigned char (*hashes)[32])
+{
+  sha256_shani_two(mid, nonces, hashes);
+  sha256_shani_two(mid, nonces + 2, hashes + 2);
+}
+
+static bool	hashkern_has_sse4()
+{
+  return (__builtin_cpu_supports("sse4.1"));
+}
+
+static bool	hashkern_has_avx2()
+{
+  return (__builtin_cpu_supports("avx2"));
+}
+
+static bool	hashkern_has_avx512()
+{
+  return (__builtin_cpu_supports("avx512f"));
+}
+
+static bool	hashkern_has_shani()
+{
+  unsigned int	eax, ebx, ecx, edx;
+
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+    return (false);
+  return (((ebx >> 29) & 1) && __builtin_cpu_supports("sse4.1"));
+}
+
+#endif
+
+
+// Known kernels. The scalar one must stay last as the fallback
+static hashkern_t	hashkerns[] =
+  {
+#ifdef HASHKERN_X86
+    { "avx512", 16, hashkern_avx512, hashkern_has_avx512 },
+    { "shani",   4, hashkern_shani,  hashkern_has_shani  },
+    { "avx2",    8, hashkern_avx2,   hashkern_has_avx2   },
+    { "sse4",    4, hashkern_sse4,   hashkern_has_sse4   },
+#endif
+    { "scalar",  1, hashkern_scalar, hashkern_always },
+  };
+
+#define HASHKERN_NUM	(sizeof(hashkerns) / sizeof(hashkerns[0]))
+
+
+// Compare a kernel against OpenSSL over the whole message for a few headers and nonces
+static bool	hashkern_selftest(hashkern_t *kern)
+{
+  unsigned char	prefix[128 + 32];
+  unsigned char	nonces[HASHKERN_MAX_LANES][32];
+  unsigned char	hashes[HASHKERN_MAX_LANES][32];
+  unsigned char	expected[32];
+  hashmid_t	mid;
+  unsigned int	round;
+  unsigned int	lane;
+
+  for (round = 0; round < 4; round++)
+    {
+      for (lane = 0; lane < 128; lane++)
+	prefix[lane] = (unsigned char) (lane * 7 + round * 13);
+      sha256_midstate(prefix, 128, &mid);
+      for (lane = 0; lane < kern->lanes; lane++)
+	{
+	  memset(nonces[lane], '0', 32);
+	  nonces[lane][31] += lane % 10;
+	  nonces[lane][30] += round;
+	}
+      kern->hash(&mid, nonces, hashes);
+      for (lane = 0; lane < kern->lanes; lane++)
+	{
+	  memcpy(prefix + 128, nonces[lane], 32);
+	  sha256(prefix, sizeof(prefix), expected);
+	  if (memcmp(expected, hashes[lane], 32) != 0)
+	    return (false);
+	}
+    }
+  return (true);
+}
+
+
+// Hashes per second of a kernel over a short run
+static double	hashkern_rate(hashkern_t *kern)
+{
+  unsigned char		prefix[128];
+  unsigned char		nonces[HASHKERN_MAX_LANES][32];
+  unsigned char		hashes[HASHKERN_MAX_LANES][32];
+  hashmid_t		mid;
+  struct timespec	start;
+  struct timespec	end;
+  ullint		total = 0;
+  double		seconds = 0;
+
+  memset(prefix, 0x00, sizeof(prefix));
+  memset(nonces, '0', sizeof(nonces));
+  sha256_midstate(prefix, sizeof(prefix), &mid);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (seconds < HASHKERN_CALIBRATE)
+    {
+      for (int idx = 0; idx < 256; idx++)
+	kern->hash(&mid, nonces, hashes);
+      total += 256 * kern->lanes;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+  return (total / seconds);
+}
+
+
+// Pick the fastest kernel supported by this CPU that agrees with OpenSSL
+// A name forces that kernel if it is supported, NULL means best available
+hashkern_t	*hashkern_select(const char *name)
+{
+  hashkern_t	*best = &hashkerns[HASHKERN_NUM - 1];
+  double	bestrate = 0;
+  unsigned int	idx;
+
+  for (idx = 0; idx < HASHKERN_NUM; idx++)
+    {
+      hashkern_t *kern = &hashkerns[idx];
+
+      if (name != NULL && strcmp(name, kern->name) != 0)
+	continue;
+      if (kern->supported() == false)
+	continue;
+      if (hashkern_selftest(kern) == false)
+	{
+	  std::cerr << "Hash kernel " << kern->name << " failed self test - skipped" << std::endl;
+	  continue;
+	}
+      if (name != NULL)
+	return (kern);
+
+      double rate = hashkern_rate(kern);
+      std::cerr << "Hash kernel " << kern->name << ": " << rate << " H/s" << std::endl;
+      if (rate > bestrate)
+	{
+	  best = kern;
+	  bestrate = rate;
+	}
+    }
+  return (best);
+}
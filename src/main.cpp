@@ -7,25 +7,56 @@ unsigned int	numcores = 0;
 std::list<int>	ports;
 unsigned int	difficulty = 1;
 unsigned int	numtxinblock = DEFAULT_TRANS_PER_BLOCK;
+unsigned int	blocktime = 0;
+unsigned int	minethreads = 0;
+unsigned int	minenice = 0;
+int		mineaffinity = -1;
+unsigned int	maxpool = DEFAULT_MEMPOOL_MAX;
+bool		journal = false;
 
 // Print help and exit on error
 void help_and_exit(std::string msg, char *str)
 {
   std::cerr << "Error : " << msg << std::endl;
-  std::cerr << "Syntax: " << std::string(str) << " [-bootstrap | -numtxinblock <num> -numworkers <num> -ports <ports> -difficulty <num> -numcores <num>]"
+  std::cerr << "Syntax: " << std::string(str) << " [-bootstrap | -numtxinblock <num> -numworkers <num> -ports <ports> -difficulty <num> -numcores <num> -blocktime <sec> -minethreads <num> -minenice <num> -mineaffinity <cpu> -mempool <num> -journal]"
 	    << std::endl;
   exit(-1);
 }
 
+// Options waiting for their value on the command line
+static bool	numworkermode = false;
+static bool	portmode = false;
+static bool	numtxmode = false;
+static bool	difficultymode = false;
+static bool	numcoresmode = false;
+static bool	blocktimemode = false;
+static bool	minethreadsmode = false;
+static bool	minenicemode = false;
+static bool	mineaffinitymode = false;
+static bool	mempoolmode = false;
+static bool	*parsemodes[] = { &numworkermode, &portmode, &numtxmode, &difficultymode,
+				  &numcoresmode, &blocktimemode, &minethreadsmode, &minenicemode,
+				  &mineaffinitymode, &mempoolmode };
+
+// Start an option: any other option still waiting for its value is an error, and all modes are
+// cleared so that the next value goes to this option. mode is NULL for options without value
+static void	parse_option(bool *mode, char *str)
+{
+  for (unsigned int idx = 0; idx < sizeof(parsemodes) / sizeof(parsemodes[0]); idx++)
+    {
+      if (*parsemodes[idx] && parsemodes[idx] != &portmode)
+	help_and_exit("Missing parameter value", str);
+      *parsemodes[idx] = false;
+    }
+  if (mode != NULL)
+    *mode = true;
+}
+
 // Parse command line parameters
 int parse(int argc, char **argv)
 {
   int index = 1;
-  bool numworkermode = false;
-  bool portmode = false;
-  bool numtxmode = false;
-  bool difficultymode = false;
-  bool numcoresmode = false;
+  bool mempoolset = false;
   char *str = NULL;
   
   while (index < argc)
@@ -38,48 +69,71 @@ int parse(int argc, char **argv)
 	}      
       else if (!strcmp(str, "-numtxinblock"))
 	{
-	  portmode = false;
-	  if (numworkermode || difficultymode || numcoresmode)
-	    help_and_exit("Missing parameter value", argv[0]);
 	  if (numtxmode)
 	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
-	  numtxmode = true;
+	  parse_option(&numtxmode, argv[0]);
 	}
       else if (!strcmp(str, "-numcores"))
 	{
-	  portmode = false;
-	  if (numworkermode || difficultymode || numtxmode)
-	    help_and_exit("Missing parameter value", argv[0]);
-	  if (numtxmode)
+	  if (numcoresmode)
 	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
-	  numcoresmode = true;
+	  parse_option(&numcoresmode, argv[0]);
 	}
       
       else if (!strcmp(str, "-numworkers"))
 	{
-	  portmode = false;
 	  if (numworkers != 0 || numworkermode)
 	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
-	  if (numtxmode || difficultymode || numcoresmode)
-	    help_and_exit("Invalid parameter", argv[0]);
-	  numworkermode = true;
+	  parse_option(&numworkermode, argv[0]);
 	}
       else if (!strcmp(str, "-ports"))
 	{
 	  if (ports.size() != 0 || portmode)
 	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
-	  if (numworkermode || numtxmode || difficultymode || numcoresmode)
-	    help_and_exit("Invalid parameter", argv[0]);
-	  portmode = true;
+	  parse_option(&portmode, argv[0]);
 	}
       else if (!strcmp(str, "-difficulty"))
 	{
-	  portmode = false;
 	  if (difficultymode)
 	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
-	  if (numworkermode || numtxmode || numcoresmode)
-	    help_and_exit("Invalid parameter", argv[0]);
-	  difficultymode = true;
+	  parse_option(&difficultymode, argv[0]);
+	}
+      else if (!strcmp(str, "-blocktime"))
+	{
+	  if (blocktimemode)
+	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
+	  parse_option(&blocktimemode, argv[0]);
+	}
+      else if (!strcmp(str, "-minethreads"))
+	{
+	  if (minethreadsmode || minethreads != 0)
+	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
+	  parse_option(&minethreadsmode, argv[0]);
+	}
+      else if (!strcmp(str, "-minenice"))
+	{
+	  if (minenicemode || minenice != 0)
+	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
+	  parse_option(&minenicemode, argv[0]);
+	}
+      else if (!strcmp(str, "-mineaffinity"))
+	{
+	  if (mineaffinitymode || mineaffinity >= 0)
+	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
+	  parse_option(&mineaffinitymode, argv[0]);
+	}
+      else if (!strcmp(str, "-journal"))
+	{
+	  if (journal)
+	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
+	  parse_option(NULL, argv[0]);
+	  journal = true;
+	}
+      else if (!strcmp(str, "-mempool"))
+	{
+	  if (mempoolmode || mempoolset)
+	    help_and_exit("Multiple occurences of option is invalid", argv[0]);
+	  parse_option(&mempoolmode, argv[0]);
 	}
       else if (*str >= '0' && *str <= '9')
 	{
@@ -106,6 +160,32 @@ int parse(int argc, char **argv)
 	      numcores = num;
 	      numcoresmode = false;
 	    }
+	  else if (blocktimemode)
+	    {
+	      blocktime = num;
+	      blocktimemode = false;
+	    }
+	  else if (minethreadsmode)
+	    {
+	      minethreads = num;
+	      minethreadsmode = false;
+	    }
+	  else if (minenicemode)
+	    {
+	      minenice = num;
+	      minenicemode = false;
+	    }
+	  else if (mineaffinitymode)
+	    {
+	      mineaffinity = num;
+	      mineaffinitymode = false;
+	    }
+	  else if (mempoolmode)
+	    {
+	      maxpool = num;
+	      mempoolmode = false;
+	      mempoolset = true;
+	    }
 	  else
 	    help_and_exit("Missing option for value", argv[0]);
 	}
@@ -128,6 +208,13 @@ int main(int argc, char **argv)
   if (bootstrap)
     execute_bootstrap();
   else
-    execute_worker(numtxinblock, difficulty, numworkers, numcores, ports);
+    {
+      minerconf_t	minerconf;
+
+      minerconf.numthreads = minethreads;
+      minerconf.nice = minenice;
+      minerconf.affinity = mineaffinity;
+      execute_worker(numtxinblock, difficulty, numworkers, numcores, ports, minerconf, maxpool, journal);
+    }
   return (0);
 }
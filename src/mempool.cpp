@@ -0,0 +1,226 @@
+#include "node.h"
+
+// Hash of the 128 bytes of a transaction, never 0 since 0 marks an empty slot
+ullint		mempool_hash(transdata_t *data)
+{
+  ullint	words[sizeof(transdata_t) / sizeof(ullint)];
+  ullint	hash = 0xCBF29CE484222325ULL;
+
+  memcpy(words, data, sizeof(words));
+  for (unsigned int idx = 0; idx < sizeof(words) / sizeof(words[0]); idx++)
+    {
+      hash = (hash ^ words[idx]) * 0x9E3779B97F4A7C15ULL;
+      hash ^= hash >> 29;
+    }
+  hash ^= hash >> 32;
+  return (hash ? hash : 1);
+}
+
+
+// Slot holding data, or the empty slot where it would go
+static ullint	mempool_probe(mempool_t& pool, transdata_t *data, ullint hash)
+{
+  ullint	mask = pool.slots.size() - 1;
+  ullint	idx = hash & mask;
+
+  while (pool.slots[idx].hash != 0)
+    {
+      if (pool.slots[idx].hash == hash &&
+	  memcmp(&pool.slots[idx].msg.data, data, sizeof(transdata_t)) == 0)
+	break;
+      idx = (idx + 1) & mask;
+    }
+  return (idx);
+}
+
+
+// Double the number of slots and put back all entries
+static void	mempool_grow(mempool_t& pool)
+{
+  std::vector<mempoolslot_t>	old;
+  ullint			size = pool.slots.size() ? pool.slots.size() * 2 : MEMPOOL_MIN_SLOTS;
+
+  old.swap(pool.slots);
+  pool.slots.resize(size);
+  for (ullint idx = 0; idx < old.size(); idx++)
+    if (old[idx].hash != 0)
+      pool.slots[mempool_probe(pool, &old[idx].msg.data, old[idx].hash)] = old[idx];
+}
+
+
+// Transaction with the same content as data, or NULL if not in the pool
+transmsg_t	*mempool_find(mempool_t& pool, transdata_t *data)
+{
+  if (pool.count == 0)
+    return (NULL);
+
+  ullint idx = mempool_probe(pool, data, mempool_hash(data));
+  if (pool.slots[idx].hash == 0)
+    return (NULL);
+  return (&pool.slots[idx].msg);
+}
+
+
+// First transaction of the pool with this hash, or NULL
+// Hashes double as short transaction ids, so a match may still be another transaction
+transmsg_t	*mempool_find_hash(mempool_t& pool, ullint hash)
+{
+  if (pool.count == 0)
+    return (NULL);
+
+  ullint	mask = pool.slots.size() - 1;
+  for (ullint idx = hash & mask; pool.slots[idx].hash != 0; idx = (idx + 1) & mask)
+    if (pool.slots[idx].hash == hash)
+      return (&pool.slots[idx].msg);
+  return (NULL);
+}
+
+
+// Add a transaction to the pool. Return false if it was already there
+bool		mempool_insert(mempool_t& pool, transmsg_t& msg)
+{
+  ullint	hash = mempool_hash(&msg.data);
+
+  // Keep the load under 3/4 so that probe sequences stay short
+  if ((pool.count + 1) * 4 > pool.slots.size() * 3)
+    mempool_grow(pool);
+
+  ullint idx = mempool_probe(pool, &msg.data, hash);
+  if (pool.slots[idx].hash != 0)
+    return (false);
+  pool.slots[idx].hash = hash;
+  pool.slots[idx].msg = msg;
+  pool.count++;
+  return (true);
+}
+
+
+// Remove a transaction from the pool. Return false if it was not there
+// Following entries of the probe sequence are shifted back, so there are no tombstones
+bool		mempool_erase(mempool_t& pool, transdata_t *data)
+{
+  if (pool.count == 0)
+    return (false);
+
+  ullint	mask = pool.slots.size() - 1;
+  ullint	hole = mempool_probe(pool, data, mempool_hash(data));
+  ullint	idx = hole;
+
+  if (pool.slots[hole].hash == 0)
+    return (false);
+  while (true)
+    {
+      idx = (idx + 1) & mask;
+      if (pool.slots[idx].hash == 0)
+	break;
+
+      // An entry can fill the hole only if its home slot is not between the hole and itself
+      ullint home = pool.slots[idx].hash & mask;
+      if (((idx - home) & mask) >= ((idx - hole) & mask))
+	{
+	  pool.slots[hole] = pool.slots[idx];
+	  hole = idx;
+	}
+    }
+  pool.slots[hole].hash = 0;
+  pool.count--;
+  return (true);
+}
+
+
+// Remove all transactions, keeping the slots allocated
+void		mempool_clear(mempool_t& pool)
+{
+  if (pool.count == 0)
+    return;
+  for (ullint idx = 0; idx < pool.slots.size(); idx++)
+    pool.slots[idx].hash = 0;
+  pool.count = 0;
+}
+
+
+// Filter block of a hash and the mask of its three bits within each 64 bit word
+// Bits 20 to 46 of the hash are left alone by table slots and shard selection
+static ullint	mempool_bloom_block(mempoolpast_t& past, ullint hash, ullint mask[MEMPOOL_BLOOM_WORDS])
+{
+  ullint	numblocks = past.bloom.size() / MEMPOOL_BLOOM_WORDS;
+
+  memset(mask, 0x00, sizeof(ullint) * MEMPOOL_BLOOM_WORDS);
+  for (unsigned int idx = 0; idx < 3; idx++)
+    {
+      unsigned int bit = (hash >> (20 + 9 * idx)) & 511;
+      mask[bit >> 6] |= 1ULL << (bit & 63);
+    }
+  return ((hash & (numblocks - 1)) * MEMPOOL_BLOOM_WORDS);
+}
+
+
+// Set the bits of one hash in the filter
+static void	mempool_bloom_add(mempoolpast_t& past, ullint hash)
+{
+  ullint	mask[MEMPOOL_BLOOM_WORDS];
+  ullint	base = mempool_bloom_block(past, hash, mask);
+
+  for (unsigned int idx = 0; idx < MEMPOOL_BLOOM_WORDS; idx++)
+    past.bloom[base + idx] |= mask[idx];
+}
+
+
+// Whether the filter may hold a hash
+static bool	mempool_bloom_test(mempoolpast_t& past, ullint hash)
+{
+  ullint	mask[MEMPOOL_BLOOM_WORDS];
+
+  if (past.exact.count == 0)
+    return (false);
+
+  ullint base = mempool_bloom_block(past, hash, mask);
+  for (unsigned int idx = 0; idx < MEMPOOL_BLOOM_WORDS; idx++)
+    if ((past.bloom[base + idx] & mask[idx]) != mask[idx])
+      return (false);
+  return (true);
+}
+
+
+// Whether data belongs to the past block. hash is mempool_hash(data)
+bool		mempool_past_find(mempoolpast_t& past, transdata_t *data, ullint hash)
+{
+  return (mempool_bloom_test(past, hash) && mempool_find(past.exact, data) != NULL);
+}
+
+
+// Whether a transaction with this hash belongs to the past block
+bool		mempool_past_find_hash(mempoolpast_t& past, ullint hash)
+{
+  return (mempool_bloom_test(past, hash) && mempool_find_hash(past.exact, hash) != NULL);
+}
+
+
+// Add a transaction of the past block
+// The filter doubles and is refilled from the table when it gets too loaded
+void		mempool_past_insert(mempoolpast_t& past, transmsg_t& msg)
+{
+  ullint	numblocks = past.bloom.size() / MEMPOOL_BLOOM_WORDS;
+
+  if (mempool_insert(past.exact, msg) == false)
+    return;
+  if (past.exact.count <= numblocks * MEMPOOL_BLOOM_LOAD)
+    {
+      mempool_bloom_add(past, mempool_hash(&msg.data));
+      return;
+    }
+  past.bloom.assign((numblocks ? numblocks * 2 : 1) * MEMPOOL_BLOOM_WORDS, 0);
+  for (ullint idx = 0; idx < past.exact.slots.size(); idx++)
+    if (past.exact.slots[idx].hash != 0)
+      mempool_bloom_add(past, past.exact.slots[idx].hash);
+}
+
+
+// Forget the past block, keeping the memory for the next one
+void		mempool_past_clear(mempoolpast_t& past)
+{
+  if (past.exact.count == 0)
+    return;
+  mempool_clear(past.exact);
+  std::fill(past.bloom.begin(), past.bloom.end(), 0);
+}
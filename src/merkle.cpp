@@ -0,0 +1,152 @@
+#include "node.h"
+
+// Hash two children into their parent node
+static void	merkle_pair(hashval_t *left, hashval_t *right, hashval_t *output)
+{
+  unsigned char	buff[64];
+
+  memcpy(buff, left->hash, 32);
+  memcpy(buff + 32, right->hash, 32);
+  sha256(buff, sizeof(buff), output->hash);
+}
+
+
+// Value of node (level, index) in the tree made of the first numleaves leaves only
+// Subtrees fully covered by the prefix are read from the tree, the right edge is recomputed
+static void	merkle_node(merkle_t& tree, unsigned int level, ullint index,
+			    ullint numleaves, hashval_t *output)
+{
+  hashval_t	left;
+  hashval_t	right;
+
+  if (((index + 1) << level) <= numleaves)
+    {
+      *output = tree.levels[level][index];
+      return;
+    }
+  merkle_node(tree, level - 1, index * 2, numleaves, &left);
+  if (((index * 2 + 1) << (level - 1)) < numleaves)
+    merkle_node(tree, level - 1, index * 2 + 1, numleaves, &right);
+  else
+    right = left;
+  merkle_pair(&left, &right, output);
+}
+
+
+// Number of levels above the leaves for a tree of numleaves leaves
+static unsigned int	merkle_depth(ullint numleaves)
+{
+  unsigned int		depth = 0;
+
+  while ((1ULL << depth) < numleaves)
+    depth++;
+  return (depth);
+}
+
+
+// Empty the tree
+void		merkle_clear(merkle_t& tree)
+{
+  tree.levels.clear();
+}
+
+
+// Add one leaf hash and update its path to the root
+// A node missing its right child is paired with itself until the sibling arrives
+static void	merkle_append_leaf(merkle_t& tree, hashval_t leaf)
+{
+  ullint	index;
+  unsigned int	level;
+
+  if (tree.levels.empty())
+    tree.levels.push_back(hashlist_t());
+  tree.levels[0].push_back(leaf);
+  index = tree.levels[0].size() - 1;
+
+  for (level = 0; tree.levels[level].size() > 1; level++)
+    {
+      hashlist_t&	cur = tree.levels[level];
+      ullint		parent = index / 2;
+      hashval_t		node;
+
+      if (parent * 2 + 1 < cur.size())
+	merkle_pair(&cur[parent * 2], &cur[parent * 2 + 1], &node);
+      else
+	merkle_pair(&cur[parent * 2], &cur[parent * 2], &node);
+      if (tree.levels.size() == level + 1)
+	tree.levels.push_back(hashlist_t());
+      hashlist_t&	up = tree.levels[level + 1];
+      if (parent == up.size())
+	up.push_back(node);
+      else
+	up[parent] = node;
+      index = parent;
+    }
+}
+
+
+// Add one transaction as the next leaf and update its path to the root
+void		merkle_append(merkle_t& tree, transdata_t *trans)
+{
+  hashval_t	leaf;
+
+  sha256((unsigned char *) trans, sizeof(transdata_t), leaf.hash);
+  merkle_append_leaf(tree, leaf);
+}
+
+
+// Keep only the first numleaves leaves
+// Right edge nodes still cover dropped leaves: putting back the last leaf recomputes them
+void		merkle_truncate(merkle_t& tree, ullint numleaves)
+{
+  hashval_t	last;
+  ullint	size;
+  unsigned int	level;
+
+  if (tree.levels.empty() || tree.levels[0].size() <= numleaves)
+    return;
+  if (numleaves == 0)
+    {
+      merkle_clear(tree);
+      return;
+    }
+  last = tree.levels[0][numleaves - 1];
+  size = numleaves - 1;
+  tree.levels[0].resize(size);
+  for (level = 1; level < tree.levels.size() && tree.levels[level - 1].size() > 1; level++)
+    {
+      size = (size + 1) / 2;
+      tree.levels[level].resize(size);
+    }
+  tree.levels.resize(level);
+  merkle_append_leaf(tree, last);
+}
+
+
+// Build the tree from scratch over an array of transactions
+void		merkle_build(merkle_t& tree, transdata_t *trans, unsigned int numtx)
+{
+  unsigned int	idx;
+
+  merkle_clear(tree);
+  for (idx = 0; idx < numtx; idx++)
+    merkle_append(tree, trans + idx);
+}
+
+
+// Root over the first numleaves leaves of the tree
+// This is free when the tree holds exactly numleaves, and costs log(numleaves) hashes otherwise
+bool		merkle_root(merkle_t& tree, unsigned int numleaves, unsigned char *output)
+{
+  hashval_t	root;
+
+  if (numleaves == 0 || tree.levels.empty() || tree.levels[0].size() < numleaves)
+    return (false);
+  if (tree.levels[0].size() == numleaves)
+    root = tree.levels.back()[0];
+  else
+    merkle_node(tree, merkle_depth(numleaves), 0, numleaves, &root);
+  memcpy(output, root.hash, 32);
+  return (true);
+}
+
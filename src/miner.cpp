@@ -0,0 +1,720 @@
+#include "node.h"
+
+extern clientmap_t	clientmap;
+extern std::atomic<ullint> transcount;
+extern pthread_mutex_t  template_lock;
+extern mempoolshard_t	transshards[MEMPOOL_SHARDS];
+extern keylist_t	transorder;
+extern ullint		transorderhead;
+extern merkle_t		transtree;
+extern blockchain_t	chain;
+extern blockmap_t	bmap;
+extern pthread_mutex_t  chain_lock;
+extern time_t		time_first_block;
+extern time_t		time_last_block;
+
+// Number of hashing threads each local worker adds to the mining engine
+static unsigned int	numminers = 1;
+
+// Process-wide mining engine shared by all local workers, and the workers it mines for
+// Hashing thread i works for worker i / numminers, which is credited with its blocks
+static miner_t		*engine = NULL;
+static std::vector<worker_t*>	localworkers;
+
+// Hashing kernel selected for this CPU at startup
+static hashkern_t	*hashkern = NULL;
+
+// Mining executor: its own threads and queue, so that rounds never hold a socket job thread
+static minerconf_t	minerconf;
+static minejobqueue_t	minejobq;
+static pthread_mutex_t	minejob_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	minejob_cond = PTHREAD_COND_INITIALIZER;
+
+
+// Apply the executor priority to the calling thread, and pin it to cpu unless cpu is -1
+static void	miner_thread_setup(int cpu)
+{
+  if (minerconf.nice > 0 &&
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), minerconf.nice) < 0)
+    perror("Failed to lower miner thread priority");
+  if (cpu >= 0)
+    {
+      cpu_set_t	set;
+
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+	std::cerr << "Failed to pin miner thread to CPU " << cpu << std::endl;
+    }
+}
+
+
+// Mining executor thread: run the mining loop of the engine whenever miner_wake queues it
+static void*	miner_executor(void *null)
+{
+  minejob_t	job;
+
+  miner_thread_setup(-1);
+  while (true)
+    {
+      pthread_mutex_lock(&minejob_lock);
+      while (minejobq.empty())
+	pthread_cond_wait(&minejob_cond, &minejob_lock);
+      job = minejobq.front();
+      minejobq.pop();
+      pthread_mutex_unlock(&minejob_lock);
+
+      do_mine(job.worker, job.difficulty, job.numtxinblock);
+    }
+  return (NULL);
+}
+
+
+// Configure the mining engine and start its executor thread
+void		miner_init(minerconf_t conf)
+{
+  pthread_t	thr;
+
+  if (conf.numthreads == 0)
+    conf.numthreads = 1;
+  if (conf.numthreads > MINER_MAX_THREADS)
+    conf.numthreads = MINER_MAX_THREADS;
+  minerconf = conf;
+  numminers = conf.numthreads;
+  hashkern = hashkern_select(NULL);
+  std::cerr << "Mining engine uses " << numminers << " hashing threads per worker with "
+	    << hashkern->name << " kernel (" << hashkern->lanes << " lanes)"
+	    << " nice " << minerconf.nice << " affinity " << minerconf.affinity << std::endl;
+
+  if (pthread_create(&thr, NULL, miner_executor, NULL) != 0)
+    FATAL("FAILED miner executor pthread_create");
+}
+
+
+// Add a local worker to the mining engine and return the engine shared by all of them
+// Each worker brings its own hashing threads to the rounds of the engine
+miner_t		*miner_register(worker_t *worker)
+{
+  if (engine == NULL)
+    {
+      engine = new miner_t();
+      engine->tid = 0;
+      engine->session = miner_session_create();
+    }
+  localworkers.push_back(worker);
+  return (engine);
+}
+
+
+// Number of hashing threads of a round: every local worker contributes numminers of them
+static unsigned int	miner_numthreads()
+{
+  unsigned int		total = numminers * localworkers.size();
+
+  if (total == 0)
+    total = numminers;
+  if (total > MINER_MAX_THREADS)
+    total = MINER_MAX_THREADS;
+  return (total);
+}
+
+
+// Local worker credited with a block found by a hashing thread
+static worker_t		*miner_owner(worker_t *worker, unsigned int index)
+{
+  if (index / numminers < localworkers.size())
+    return (localworkers[index / numminers]);
+  return (worker);
+}
+
+
+// Hand the mining loop to the executor on behalf of a worker, unless it is already running
+// Returns immediately so that the calling socket job thread goes back to I/O
+void		miner_wake(worker_t *worker, int difficulty, int numtxinblock)
+{
+  minejob_t	job;
+
+  // Only one mining loop per process - a running one will pick up new transactions
+  if (worker->miner->session->running.exchange(true) == true)
+    return;
+  job.worker = worker;
+  job.difficulty = difficulty;
+  job.numtxinblock = numtxinblock;
+  pthread_mutex_lock(&minejob_lock);
+  minejobq.push(job);
+  pthread_cond_signal(&minejob_cond);
+  pthread_mutex_unlock(&minejob_lock);
+}
+
+
+// Treat event when new block was mined
+// Return -1 without touching the chain if a received block made this one stale
+static int	miner_update(worker_t *worker, blockmsg_t newblock, char *data, int numtxinblock)
+{
+  std::cerr << "MINER READ!" << std::endl;
+
+  // Make sure nobody can touch the chain while we execute transaction and stack new block
+  //std::cerr << "Acquiring chain lock..." << std::endl;
+  pthread_mutex_lock(&chain_lock);
+  //std::cerr << "Acquired chain lock..." << std::endl;
+
+  // The chain moved while we were finishing - our transactions are already back in the pool
+  if (worker->miner->session->stale.load())
+    {
+      std::cerr << "Mined block is stale - dropping" << std::endl;
+      pthread_mutex_unlock(&chain_lock);
+      return (-1);
+    }
+
+  // A block accepted between reading the top and taking the template is not flagged as stale:
+  // the mined block must still sit right on top of the chain
+  unsigned char	expheight[32];
+  unsigned char	exphash[32];
+  if (chain.empty())
+    {
+      memset(expheight, '0', sizeof(expheight));
+      memset(exphash, '0', sizeof(exphash));
+      sha256(exphash, sizeof(exphash), exphash);
+    }
+  else
+    {
+      memcpy(expheight, chain.top().hdr.height, sizeof(expheight));
+      string_integer_increment((char *) expheight, sizeof(expheight));
+      memcpy(exphash, chain.top().hdr.hash, sizeof(exphash));
+    }
+  if (memcmp(newblock.height, expheight, 32) != 0 || memcmp(newblock.priorhash, exphash, 32) != 0)
+    {
+      std::cerr << "Mined block does not extend the chain top - dropping" << std::endl;
+      miner_abort(*worker->miner, numtxinblock);
+      pthread_mutex_unlock(&chain_lock);
+      return (-1);
+    }
+
+  // Execute all transactions of the block before their pending debits are released below,
+  // so that admission never sees the old balance without the debit. A block that does not
+  // apply whole is not sent: its transactions go back to the pool and the debits are recomputed
+  if (trans_commit((transdata_t *) data, numtxinblock, newblock.hash) != numtxinblock)
+    {
+      std::cerr << "Mined block does not apply to the accounts - dropping" << std::endl;
+      miner_abort(*worker->miner, numtxinblock);
+      trans_pool_lockall();
+      trans_spend_recheck();
+      trans_pool_unlockall();
+      pthread_mutex_unlock(&chain_lock);
+      return (-1);
+    }
+
+  // Send block to all remotes, as one message so that other senders cannot split it
+  // This comes from a local miner so there is no verification to perform
+  std::string	blockmsg(1, OPCODE_SENDBLOCK);
+  blockmsg.append((char *) &newblock, sizeof(newblock));
+  blockmsg.append(data, sizeof(transdata_t) * numtxinblock);
+  for (clientmap_t::iterator it = clientmap.begin(); it != clientmap.end(); it++)
+    {
+      remote_t	remote = it->second;
+
+      if (worker->serv_port == remote.remote_port)
+	{
+	  std::cerr << "Do not send the block to yourself - passing" << std::endl;
+	  continue;
+	}
+      std::cerr << "Sending block to remote on sock " << remote.client_sock
+		<< " no port " << remote.remote_port << std::endl;
+      async_send(remote.client_sock, (char *) blockmsg.data(), blockmsg.size(),
+		 "Miner update", false);
+    }
+
+  // Transactions are marked as past instead of pending
+  //std::cerr << "Acquiring trans lock..." << std::endl;
+  pthread_mutex_lock(&template_lock);
+  trans_pool_lockall();
+  //std::cerr << "Acquired trans lock..." << std::endl;
+
+  // The past pool keeps the last MEMPOOL_PAST_BLOCKS blocks, this one replaces the oldest
+  trans_pool_rotate();
+  for (int idx = 0; idx < numtxinblock; idx++)
+    {
+      transmsg_t	msg;
+
+      msg.hdr.opcode = OPCODE_SENDTRANS;
+      msg.data = ((transdata_t *) data)[idx];
+      mempool_erase(trans_pool_shard(&msg.data)->taken, &msg.data);
+      trans_spend_release(&msg.data);
+      trans_pool_expire(msg);
+    }
+  worker->miner->session->bufftaken = false;
+
+  //std::cerr << "Releasing translock..." << std::endl;
+  trans_pool_unlockall();
+  pthread_mutex_unlock(&template_lock);
+
+  // Some debug
+  std::string hash  = hash2str(newblock.hash);
+  std::string phash = hash2str(newblock.priorhash);
+  std::cerr << "Miner pushing new block: " << std::endl
+	    << " new top hash       = " << hash << std::endl
+	    << " new top prior hash = " << phash << std::endl;
+
+  // Create block and push it on chain
+  block_t    chain_elem;
+  chain_elem.hdr = newblock;
+  chain_elem.trans = (transdata_t *) data;
+  chain.push(chain_elem);
+  std::string height = tag2str(newblock.height);
+  bmap[height] = chain_elem;
+
+  // Statistics on performance
+  time_t curtime;
+  time(&curtime);
+  if (time_first_block == 0)
+    time_first_block = curtime;
+  if (time_last_block == 0)
+    time_last_block = curtime;
+  double since_first_block = difftime(curtime, time_first_block);
+  double since_last_block  = difftime(curtime, time_last_block);
+  time_last_block = curtime;
+  std::string curheight = tag2str(newblock.height);
+  std::cerr << "CHAIN/ACCOUNTS UPDATE : new current height = " << curheight
+	    << " on port " << worker->serv_port
+	    << " SEC_SINCE_LAST:  " << since_last_block
+	    << " SEC_SINCE_FIRST: " << since_first_block
+	    << " BITS: " << std::hex << be32_load(((blockwork_t *) newblock.nonce)->bits) << std::dec
+	    << std::endl;
+  std::cerr << "STATS:" << curheight << "," << since_first_block << std::endl;
+  trans_pool_stats();
+  journal_compact(false);
+
+  // Done updating the chain
+  //std::cerr << "Releasing chain lock..." << std::endl;
+  pthread_mutex_unlock(&chain_lock);
+
+  return (0);
+}
+
+// Perform the action of mining over one batch of nonces
+// Only the nonces are hashed on top of the midstate of the constant header prefix
+// Return the lane holding a valid hash, or -1 if none
+int		do_mine_hash(hashkern_t *kern, hashmid_t *midstate, unsigned char (*nonces)[32],
+			     unsigned char *target, unsigned char (*hashes)[32])
+{
+  kern->hash(midstate, nonces, hashes);
+  for (unsigned int lane = 0; lane < kern->lanes; lane++)
+    if (hash_check_target(hashes[lane], target))
+      return (lane);
+  return (-1);
+}
+
+
+// Elapsed time in seconds between two monotonic clock samples
+static double	elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+  return ((end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+
+// Hashing thread: search its own slice of the nonce space until any thread wins
+// The extra nonce moves forward whenever the slice of the 64-bit nonce is exhausted
+static void*	mine_thread(void *arg)
+{
+  mineslot_t		*slot = (mineslot_t *) arg;
+  mineround_t		*round = slot->round;
+  blockwork_t		*work = (blockwork_t *) slot->data.nonce;
+  hashkern_t		*kern = slot->kern;
+  unsigned char		nonces[HASHKERN_MAX_LANES][32];
+  unsigned char		hashes[HASHKERN_MAX_LANES][32];
+  struct timespec	start;
+  struct timespec	end;
+  const ullint		mask = (1ULL << MINER_NONCE_SHIFT) - 1;
+  ullint		base = (ullint) slot->index << MINER_NONCE_SHIFT;
+  ullint		counter = 0;
+  ullint		extranonce = 0;
+  unsigned int		lane;
+  int			found;
+
+  miner_thread_setup(slot->cpu);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (round->found.load(std::memory_order_relaxed) == false &&
+	 round->stale->load(std::memory_order_relaxed) == false)
+    {
+      // Lay out the next batch of consecutive nonces, one per kernel lane
+      for (lane = 0; lane < kern->lanes; lane++)
+	{
+	  be64_store(work->extranonce, extranonce);
+	  be64_store(work->nonce, base | counter);
+	  memcpy(nonces[lane], slot->data.nonce, sizeof(slot->data.nonce));
+	  counter = (counter + 1) & mask;
+	  if (counter == 0)
+	    extranonce++;
+	}
+      slot->hashes += kern->lanes;
+      found = do_mine_hash(kern, slot->midstate, nonces, slot->target, hashes);
+      if (found >= 0)
+	{
+	  // Only the first thread to find a valid hash gets to report it
+	  if (round->found.exchange(true) == false)
+	    {
+	      memcpy(round->nonce, nonces[found], sizeof(round->nonce));
+	      memcpy(round->hash, hashes[found], sizeof(round->hash));
+	      round->winner = slot->index;
+	    }
+	  break;
+	}
+    }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  slot->seconds = elapsed_seconds(&start, &end);
+  return (NULL);
+}
+
+
+// Move the first transactions of the template order into a template (template lock held)
+// The order is contiguous so the template is one copy, the tree was hashed in beforehand
+// Shards are locked once for the whole template. Return false when the pool does not hold enough
+static bool	miner_take(int numtxinblock, char *buff, unsigned char *txroot)
+{
+  trans_pool_drain();
+  trans_pool_tree(numtxinblock);
+  trans_pool_lockall();
+
+  // Entries of transactions that left the pool, or came back after an eviction, must be dropped
+  // before picking the template. Every picked entry is checked since an eviction and an admission
+  // can cross without changing the count
+  for (ullint idx = transorderhead; idx < transorderhead + numtxinblock && idx < transorder.size(); idx++)
+    {
+      transdata_t *cur = &transorder[idx];
+      if (mempool_find(trans_pool_shard(cur)->pool, cur) == NULL ||
+	  (idx != transorderhead && memcmp(cur - 1, cur, sizeof(transdata_t)) == 0))
+	{
+	  trans_pool_rebuild();
+	  trans_pool_tree(numtxinblock);
+	  break;
+	}
+    }
+  if (transorder.size() - transorderhead < (unsigned int) numtxinblock)
+    {
+      trans_pool_unlockall();
+      return (false);
+    }
+  transdata_t *order = transorder.data() + transorderhead;
+  merkle_root(transtree, numtxinblock, txroot);
+  memcpy(buff, order, sizeof(transdata_t) * numtxinblock);
+
+  ullint moved = 0;
+  for (int idx = 0; idx < numtxinblock; idx++)
+    {
+      mempoolshard_t	*shard = trans_pool_shard(&order[idx]);
+      transmsg_t	msg;
+
+      msg.hdr.opcode = OPCODE_SENDTRANS;
+      msg.data = order[idx];
+      mempool_insert(shard->taken, msg);
+      if (mempool_erase(shard->pool, &order[idx]))
+	moved++;
+    }
+  transcount -= moved;
+  trans_pool_unlockall();
+
+  // Leaves move down with the order: the tree of the next template is hashed in the next round
+  trans_pool_advance(numtxinblock);
+  merkle_clear(transtree);
+  return (true);
+}
+
+
+// Prepare the transactions of the next template from what arrived during the current round
+// Only the header is left to fill when the hashers switch to it
+static void	miner_prepare(worker_t *worker, int numtxinblock)
+{
+  minesession_t	*session = worker->miner->session;
+
+  // Keep the template order and its tree up to date with admissions in the meantime
+  if (session->nextready)
+    {
+      pthread_mutex_lock(&template_lock);
+      trans_pool_drain();
+      trans_pool_tree(numtxinblock);
+      pthread_mutex_unlock(&template_lock);
+      return;
+    }
+  if (session->nextbuff == NULL)
+    {
+      session->nextbuff = (char *) malloc(sizeof(transdata_t) * numtxinblock);
+      if (session->nextbuff == NULL)
+	FATAL("FAILED miner next malloc");
+    }
+  pthread_mutex_lock(&template_lock);
+  if (session->stale.load() == false &&
+      miner_take(numtxinblock, session->nextbuff, session->nextroot))
+    session->nextready = true;
+  pthread_mutex_unlock(&template_lock);
+}
+
+
+// Run one mining round over the prepared header using the hashing threads of all local workers
+// The top byte of the nonce carries the thread index so that slices never overlap
+// Return 0 when a nonce was found, -1 when the round was abandoned as stale
+static int	mine_round(worker_t *worker, blockhash_t *data, int numtxinblock, mineround_t *round)
+{
+  mineslot_t	slots[MINER_MAX_THREADS];
+  hashmid_t	midstate;
+  unsigned char	target[32];
+  unsigned int	numthreads = miner_numthreads();
+  unsigned int	idx;
+  ullint	total = 0;
+  double	seconds = 0;
+  long		numcpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (numcpus <= 0)
+    numcpus = 1;
+
+  // Everything before the nonce is the same for all attempts of this round
+  // The hash kernels only finish a midstate of whole blocks with a 32 bytes nonce block
+  static_assert(offsetof(blockhash_t, nonce) % 64 == 0 &&
+		sizeof(blockhash_t) - offsetof(blockhash_t, nonce) == 32,
+		"hash kernels need the header nonce alone in the last 64 bytes block");
+  sha256_midstate((unsigned char *) data, offsetof(blockhash_t, nonce), &midstate);
+  target_from_bits(be32_load(((blockwork_t *) data->nonce)->bits), target);
+
+  round->found = false;
+  round->winner = 0;
+  for (idx = 0; idx < numthreads; idx++)
+    {
+      mineslot_t	*slot = &slots[idx];
+
+      slot->index = idx;
+      slot->data = *data;
+      slot->midstate = &midstate;
+      slot->kern = hashkern;
+      slot->target = target;
+      slot->hashes = 0;
+      slot->seconds = 0;
+      slot->round = round;
+      slot->cpu = minerconf.affinity < 0 ? -1 : (minerconf.affinity + idx) % numcpus;
+      if (pthread_create(&slot->tid, NULL, mine_thread, slot) != 0)
+	FATAL("FAILED miner pthread_create");
+    }
+
+  // While hashers work, this thread builds the next template
+  while (round->found.load() == false && round->stale->load() == false)
+    {
+      miner_prepare(worker, numtxinblock);
+      usleep(MINER_POLL_USEC);
+    }
+
+  for (idx = 0; idx < numthreads; idx++)
+    {
+      mineslot_t *slot = &slots[idx];
+
+      pthread_join(slot->tid, NULL);
+      std::cerr << "MINER thread " << idx << " on port " << miner_owner(worker, idx)->serv_port
+		<< ": " << slot->hashes << " hashes in " << slot->seconds << " sec ("
+		<< (slot->seconds > 0 ? slot->hashes / slot->seconds : 0) << " H/s)" << std::endl;
+      total += slot->hashes;
+      if (slot->seconds > seconds)
+	seconds = slot->seconds;
+    }
+
+  worker->miner->session->hashes += total;
+  worker->miner->session->hashtime += seconds;
+  std::cerr << "HASHRATE:" << numthreads << "," << total << ","
+	    << (seconds > 0 ? total / seconds : 0) << std::endl;
+  if (round->found.load() == false)
+    return (-1);
+  return (0);
+}
+
+
+// Create the mining session of the engine
+minesession_t	*miner_session_create()
+{
+  minesession_t	*session = new minesession_t();
+
+  session->running = false;
+  session->stale = false;
+  session->buff = NULL;
+  session->nextbuff = NULL;
+  session->nextready = false;
+  session->bufftaken = false;
+  session->mined = 0;
+  session->aborted = 0;
+  session->hashes = 0;
+  session->hashtime = 0;
+  session->templates = 0;
+  session->buildtime = 0;
+  return (session);
+}
+
+
+// Mark the current round of a miner stale and put its transactions back in the pool
+// Called with the chain lock held: hashers stop within one batch and the block is dropped
+void		miner_abort(miner_t& miner, unsigned int numtxinblock)
+{
+  minesession_t	*session = miner.session;
+
+  pthread_mutex_lock(&template_lock);
+  if (session->bufftaken || session->nextready)
+    {
+      session->stale = true;
+      session->aborted++;
+      trans_pool_lockall();
+      if (session->bufftaken)
+	trans_pool_restore((transdata_t *) session->buff, numtxinblock);
+
+      // The prepared template may hold transactions of the received block - drop it too
+      if (session->nextready)
+	trans_pool_restore((transdata_t *) session->nextbuff, numtxinblock);
+      trans_pool_unlockall();
+      session->bufftaken = false;
+      session->nextready = false;
+      std::cerr << "Aborted mining round of tid " << miner.tid << " ("
+		<< session->aborted << " stale rounds so far)" << std::endl;
+    }
+  pthread_mutex_unlock(&template_lock);
+}
+
+
+// Build the next block template on top of the chain into the session buffer
+// Transactions come from the template prepared during the last round when available
+// Return false when the pool does not hold enough transactions
+static bool	miner_template(worker_t *worker, int difficulty, int numtxinblock,
+			       blockmsg_t *newblock, blockhash_t *data, bool *prepared)
+{
+  minesession_t	*session = worker->miner->session;
+  blockwork_t	*work = (blockwork_t *) newblock->nonce;
+  unsigned char	txroot[32];
+  struct timespec	start;
+  struct timespec	end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Waits for any chain update in progress to complete
+  pthread_mutex_lock(&chain_lock);
+  if (false == chain.empty())
+    {
+      block_t      lastblock = chain.top();
+      blockmsg_t   header    = lastblock.hdr;
+      memcpy(newblock->priorhash, header.hash, sizeof(newblock->priorhash));
+      memcpy(newblock->height, header.height, sizeof(newblock->height));
+      string_integer_increment((char *) newblock->height, sizeof(newblock->height));
+    }
+  else
+    {
+      unsigned char	  priorhash[32];
+      memset(priorhash, '0', sizeof(priorhash));
+      sha256(priorhash, sizeof(priorhash), newblock->priorhash);
+      memset(newblock->height, '0', sizeof(newblock->height));
+    }
+  memset(newblock->nonce, 0x00, sizeof(newblock->nonce));
+  be32_store(work->bits, chain_next_bits(difficulty));
+  be64_store(work->time, time(NULL));
+  pthread_mutex_unlock(&chain_lock);
+  sha256_mineraddr(newblock->mineraddr);
+
+  //std::cerr << "Acquiring trans lock..." << std::endl;
+  pthread_mutex_lock(&template_lock);
+  //std::cerr << "Acquired trans lock..." << std::endl;
+
+  // Switch to the template prepared during the previous round if there is one
+  if (session->nextready)
+    {
+      char *buff = session->buff;
+      session->buff = session->nextbuff;
+      session->nextbuff = buff;
+      memcpy(txroot, session->nextroot, sizeof(txroot));
+      session->nextready = false;
+      *prepared = true;
+    }
+  else
+    {
+      if (session->buff == NULL)
+	{
+	  session->buff = (char *) malloc(sizeof(transdata_t) * numtxinblock);
+	  if (session->buff == NULL)
+	    FATAL("FAILED miner malloc");
+	}
+      while (miner_take(numtxinblock, session->buff, txroot) == false)
+	{
+	  // Admissions do not take the template lock: one that saw the miner running just
+	  // before it stopped is caught by checking the pool again after releasing the session
+	  session->running = false;
+	  if (transcount.load() < (unsigned int) numtxinblock ||
+	      session->running.exchange(true) == true)
+	    {
+	      pthread_mutex_unlock(&template_lock);
+	      return (false);
+	    }
+	}
+      *prepared = false;
+    }
+  session->bufftaken = true;
+  session->stale = false;
+
+  //std::cerr << "Releasing transpool lock..." << std::endl;
+  pthread_mutex_unlock(&template_lock);
+
+  // Transactions are committed once - attempts only hash the compact header
+  pack_blockhash(newblock, txroot, data);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  session->templates++;
+  session->buildtime += elapsed_seconds(&start, &end);
+  return (true);
+}
+
+
+// Perform the action of mining:
+// Keep mining blocks as long as the pool holds enough transactions
+// Runs on the mining executor thread once miner_wake claimed the session for worker
+// Each block is announced by the local worker whose hashing thread found it
+int		do_mine(worker_t *worker, int difficulty, int numtxinblock)
+{
+  minesession_t		*session = worker->miner->session;
+  mineround_t		round;
+  blockmsg_t		newblock;
+  blockhash_t		data;
+  worker_t		*winner;
+  struct timespec	idle_start;
+  struct timespec	idle_end;
+  bool			prepared;
+  bool			idle = false;
+
+  worker->miner->tid = pthread_self();
+  round.stale = &session->stale;
+
+  while (miner_template(worker, difficulty, numtxinblock, &newblock, &data, &prepared))
+    {
+      // Time hashers spent waiting between the end of a round and new work
+      if (idle)
+	{
+	  clock_gettime(CLOCK_MONOTONIC, &idle_end);
+	  std::cerr << "IDLE:" << elapsed_seconds(&idle_start, &idle_end) << ","
+		    << prepared << std::endl;
+	}
+
+      // Mine
+      int ret = mine_round(worker, &data, numtxinblock, &round);
+      clock_gettime(CLOCK_MONOTONIC, &idle_start);
+      idle = true;
+      if (ret < 0)
+	{
+	  std::cerr << "WORKER on port " << worker->serv_port
+		    << " switching to new work after stale round" << std::endl;
+	  continue;
+	}
+      memcpy(newblock.nonce, round.nonce, sizeof(newblock.nonce));
+      memcpy(newblock.hash, round.hash, sizeof(newblock.hash));
+      winner = miner_owner(worker, round.winner);
+
+      std::cerr << "WORKER on port " << winner->serv_port << " MINED BLOCK! (thread "
+		<< round.winner << ")" << std::endl;
+
+      if (miner_update(winner, newblock, session->buff, numtxinblock) < 0)
+	continue;
+
+      // The chain now owns the buffer - the next template gets a fresh one
+      session->buff = NULL;
+      session->mined++;
+    }
+  worker->miner->tid = 0;
+
+  // Return to main loop
+  return (0);
+}
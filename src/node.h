@@ -1,13 +1,23 @@
 #include <iostream>
+#include <algorithm>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <queue>
+#include <deque>
 #include <stack>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <errno.h>
@@ -19,6 +29,9 @@
 #include <signal.h>
 #include <pthread.h>
 #include <time.h>
+#include <math.h>
+#include <atomic>
+#include <memory>
 
 // Types
 typedef struct __attribute__((packed, aligned(1))) bootmsg
@@ -67,14 +80,33 @@ typedef struct __attribute__((packed, aligned(1))) blockmsg
   unsigned char		mineraddr[32];
 }			blockmsg_t;
 
+// Binary layout of the 32 bytes nonce field of a block, all integers big endian
+// bits is the compact target the block was mined against, time its creation in seconds
+typedef struct __attribute__((packed, aligned(1))) blockwork
+{
+  unsigned char		bits[4];
+  unsigned char		time[8];
+  unsigned char		reserved[4];
+  unsigned char		extranonce[8];
+  unsigned char		nonce[8];
+}			blockwork_t;
+
+// Compact header covered by the block hash. Transactions are committed through txroot
+// and the nonce comes last so that the first 128 bytes are hashed once per template
 typedef struct __attribute__((packed, aligned(1))) blockdata
 {
-  unsigned char		nonce[32];
   unsigned char		priorhash[32];
   unsigned char		height[32];
   unsigned char		mineraddr[32];
+  unsigned char		txroot[32];
+  unsigned char		nonce[32];
 }			blockhash_t;
 
+typedef struct __attribute__((packed, aligned(1))) hashval
+{
+  unsigned char		hash[32];
+}			hashval_t;
+
 typedef struct		block
 {
   blockmsg_t		hdr;
@@ -88,9 +120,15 @@ typedef struct		remote
   char			remote_node_addr[32];
 }			remote_t;
 
+// Balances are native integers, amounts are 32 ASCII decimal digits on the wire only
+// 128 bits hold every 32 digits value, AMOUNT_MAX being the largest one
+typedef unsigned __int128	 amount_t;
+
+#define AMOUNT_MAX		 ((amount_t) 10000000000000000ULL * 10000000000000000ULL - 1)
+
 typedef struct		 account
 {
-   unsigned char	 amount[32];
+   amount_t		 amount;
 }			 account_t;
 
 // Typedefs
@@ -98,22 +136,236 @@ typedef unsigned long long int		ullint;
 typedef unsigned int			uint;
 typedef std::list<bootclient_t>		bootmap_t;
 typedef std::map<int, remote_t>		clientmap_t;
-typedef std::map<std::string,account_t> UTXO;
-typedef std::map<std::string,transmsg_t> mempool_t;
+// Accounts sit in a dense table addressed by account index
+// The index of an account is found from its 32 bytes binary key, a sha256 output,
+// so its first bytes are hash enough
+typedef struct		accountkeyhash
+{
+  size_t		operator()(const hashval_t& key) const
+  {
+    size_t		value;
+
+    memcpy(&value, key.hash, sizeof(value));
+    return (value);
+  }
+}			accountkeyhash_t;
+
+typedef struct		accountkeyeq
+{
+  bool			operator()(const hashval_t& first, const hashval_t& second) const
+  {
+    return (memcmp(first.hash, second.hash, sizeof(first.hash)) == 0);
+  }
+}			accountkeyeq_t;
+
+typedef std::unordered_map<hashval_t, uint, accountkeyhash_t, accountkeyeq_t> accountindex_t;
+
+// Account balances are held in copy-on-write pages. Versions of the state share the pages
+// they did not write, so forking a version copies page pointers only. A published version
+// is never written again: blocks execute on a fork that replaces it as a whole
+#define ACCOUNT_PAGE_SIZE	256
+
+typedef struct		accountpage
+{
+  account_t		accounts[ACCOUNT_PAGE_SIZE];
+}			accountpage_t;
+
+typedef struct		accountstate
+{
+  std::vector<std::shared_ptr<accountpage_t> > pages;
+  uint			count;
+}			accountstate_t;
+
+typedef std::shared_ptr<accountstate_t>	stateref_t;
+
+// Accounts are added at initialization only, so the key index is shared by all versions
+typedef struct		utxo
+{
+  stateref_t		current;
+  accountindex_t	index;
+}			UTXO;
+
+// Undo journal of a committed block: the balance of every account it touched, before it
+// Journals of the last UNDO_BLOCKS_MAX committed blocks are kept, keyed by binary block hash,
+// and the whole state before each of the last STATE_SNAPSHOTS_MAX ones
+#define UNDO_BLOCKS_MAX		64
+#define STATE_SNAPSHOTS_MAX	8
+
+typedef struct		accountundo
+{
+  uint			account;
+  amount_t		amount;
+}			accountundo_t;
+
+typedef std::vector<accountundo_t>		undolist_t;
+typedef std::map<std::string, undolist_t>	undomap_t;
+typedef std::map<std::string, stateref_t>	statemap_t;
+
+// Blocks of at least EXEC_PARALLEL_MIN transactions are executed on up to execthreads threads
+// Transactions are grouped by connected accounts, each group running in block order on one thread
+#define EXEC_PARALLEL_MIN	4096
+
+typedef struct		execslot
+{
+  pthread_t		tid;
+  accountstate_t	*state;
+  transdata_t		*data;
+  int			*parties;
+  std::vector<int>	txs;
+  bool			revert;
+  int			executed;
+}			execslot_t;
 typedef std::stack<block_t>		blockchain_t;
 typedef std::map<std::string,block_t>	blockmap_t;
 typedef std::list<block_t>		blocklist_t;
 typedef std::pair<blocklist_t,blocklist_t> blocklistpair_t;
 typedef std::map<int,pthread_t>		threadmap_t;
 typedef std::map<int,std::string>	sockmap_t;
+typedef std::vector<hashval_t>		hashlist_t;
+typedef std::vector<transdata_t>	keylist_t;
+
+// Mempool: open addressing table keyed on the 128 bytes of the transaction itself
+// Linear probing over a power of two number of slots, hash 0 marks an empty slot
+typedef struct		mempoolslot
+{
+  ullint		hash;
+  transmsg_t		msg;
+}			mempoolslot_t;
+
+typedef struct		mempool
+{
+  std::vector<mempoolslot_t> slots;
+  ullint		count = 0;
+}			mempool_t;
+
+// Number of past blocks whose transactions are rejected as replays
+#define MEMPOOL_PAST_BLOCKS	8
+
+// Past block filters: 512 bit blocks of 8 words, doubled above 48 entries per block
+#define MEMPOOL_BLOOM_WORDS	8
+#define MEMPOOL_BLOOM_LOAD	48
+
+// Transactions of one past block in a shard: a blocked Bloom filter in front of an exact table
+// The filter answers most lookups of new transactions without touching the table
+typedef struct		mempoolpast
+{
+  std::vector<ullint>	bloom;
+  mempool_t		exact;
+}			mempoolpast_t;
+
+// Shard of the mempool, picked by transaction hash and protected by its own lock
+// pool holds transactions waiting for a block, taken those in miner templates
+// and past those of the last blocks, one generation per block, transpast being the newest.
+// fresh lists admissions not yet in the template order
+typedef struct		mempoolshard
+{
+  pthread_mutex_t	lock;
+  mempool_t		pool;
+  mempool_t		taken;
+  mempoolpast_t		past[MEMPOOL_PAST_BLOCKS];
+  keylist_t		fresh;
+  std::vector<transdata_t> ages;	// Min-heap of pool timestamps, entries may have left the pool
+}			mempoolshard_t;
+
+// Transactions are announced by id: their 8 bytes mempool hash, big endian on the wire
+// Ids a peer is known to have, announced to it or by it, in two generations so that the
+// older one can be dropped at once
+typedef std::unordered_set<ullint>	idset_t;
+
+typedef struct		peerinv
+{
+  idset_t		known[2];
+}			peerinv_t;
+
+// Pending debits of the senders of transactions in the mempool or in miner templates
+// Keyed on the 32 bytes binary account, sharded by account and protected by its own lock
+// A spend lock is always taken last, after any shard lock
+typedef std::unordered_map<std::string, account_t>	spendmap_t;
+
+typedef struct		spendshard
+{
+  pthread_mutex_t	lock;
+  spendmap_t		debits;
+}			spendshard_t;
+
+// Mining session of the mining engine
+// The stale flag is raised when a received block invalidates the round being mined
+typedef struct		minesession
+{
+  std::atomic<bool>	running;
+  std::atomic<bool>	stale;
+  char			*buff;
+  char			*nextbuff;
+  unsigned char		nextroot[32];
+  bool			nextready;
+  bool			bufftaken;	// buff holds a template taken from the pool, as nextbuff when nextready
+  ullint		mined;
+  ullint		aborted;
+  ullint		hashes;		// Hashes computed and hashing wall time of all rounds
+  double		hashtime;
+  ullint		templates;	// Templates built and time spent building them
+  double		buildtime;
+}			minesession_t;
 
 // Data types depending on typedefs
 typedef struct		miner
 {
   pthread_t		tid;
-  mempool_t		pending;
+  minesession_t		*session;
 }			miner_t;
 
+// Merkle tree over transactions. levels[0] holds leaf hashes, the last level holds the root
+typedef struct		merkle
+{
+  std::vector<hashlist_t> levels;
+}			merkle_t;
+
+// SHA-256 state after the constant prefix of the block header
+typedef struct		hashmid
+{
+  unsigned int		state[8];
+  unsigned int		bits;
+  unsigned int		len;
+  unsigned int		restlen;
+  unsigned char		rest[64];
+}			hashmid_t;
+
+// Batched hashing kernel: finishes the midstate with lanes nonces per call
+typedef void		(*hashfn_t)(hashmid_t *mid, unsigned char (*nonces)[32],
+				    unsigned char (*hashes)[32]);
+typedef struct		hashkern
+{
+  const char		*name;
+  unsigned int		lanes;
+  hashfn_t		hash;
+  bool			(*supported)();
+}			hashkern_t;
+
+// Shared result of a mining round, written once by the winning hashing thread
+typedef struct		mineround
+{
+  std::atomic<bool>	found;
+  std::atomic<bool>	*stale;
+  unsigned int		winner;
+  unsigned char		nonce[32];
+  unsigned char		hash[32];
+}			mineround_t;
+
+// Per-thread state of the mining engine
+typedef struct		mineslot
+{
+  pthread_t		tid;
+  unsigned int		index;
+  blockhash_t		data;
+  hashmid_t		*midstate;
+  hashkern_t		*kern;
+  unsigned char		*target;
+  ullint		hashes;
+  double		seconds;
+  int			cpu;
+  mineround_t		*round;
+}			mineslot_t;
+
 
 // State machine for chain synchronization
 typedef enum	chain_state 
@@ -127,7 +379,6 @@ typedef enum	chain_state
 typedef struct		s_state
 {
   blocklist_t		*added;
-  blocklist_t		*dropped;
   unsigned char		expected_height[32]; // We know we fully synced once we found this one
   unsigned char		working_height[32];  // Currently looking up at his height
   int			chain_state;
@@ -143,7 +394,7 @@ typedef struct		worker
   unsigned short	serv_port;
   std::list<int>	clients;
   state_t		state;
-  miner_t		miner;
+  miner_t		*miner;		// Mining engine shared by all workers of the process
 }			worker_t;
 
 typedef struct		ctx
@@ -161,7 +412,26 @@ typedef struct		job
 }			job_t;
 
 typedef std::queue<job_t>		jobqueue_t;
+
+// Mining executor settings, independent from the socket job threads
+typedef struct		minerconf
+{
+  unsigned int		numthreads;	// Hashing threads per round
+  int			nice;		// Nice value of mining threads, 0 keeps the node priority
+  int			affinity;	// First CPU hashing threads are pinned to, -1 for none
+}			minerconf_t;
+
+// Request for the mining executor to run the mining loop of a worker
+typedef struct		minejob
+{
+  worker_t		*worker;
+  int			numtxinblock;
+  int			difficulty;
+}			minejob_t;
+
+typedef std::queue<minejob_t>		minejobqueue_t;
 typedef std::map<int, worker_t>		workermap_t;
+typedef std::map<int, peerinv_t>	peerinvmap_t;
 typedef std::map<int, miner_t>		minermap_t;
 
 
@@ -171,6 +441,28 @@ typedef std::map<int, miner_t>		minermap_t;
 #define OPCODE_GETBLOCK		'2'
 #define OPCODE_GETHASH		'3'
 #define OPCODE_SENDPORTS	'4'
+#define OPCODE_POOLFULL		'5'	// Reply to a transaction sender: the mempool is shedding load
+#define OPCODE_SENDTRANSBATCH	'6'	// Big endian 4 bytes count followed by count transdata_t
+#define OPCODE_INV		'7'	// Big endian 4 bytes count of sender ports, the ports, then count and ids
+#define OPCODE_GETDATA		'8'	// Big endian 4 bytes count followed by count ids
+
+// Most transactions carried by one SENDTRANSBATCH message, ids by one INV or GETDATA and
+// listening ports of the sender node by one INV
+// Relayed transactions are coalesced for at most TRANS_RELAY_USEC before being announced
+#define TRANS_BATCH_MAX		4096
+#define TRANS_INV_MAX		65536
+#define TRANS_INV_PORTS_MAX	1024
+#define TRANS_RELAY_USEC	5000
+
+// Ids remembered per peer and per generation, and delay before an id is requested again
+#define TRANS_KNOWN_MAX		65536
+#define TRANS_GETDATA_USEC	2000000
+
+// Mempool journal: records are written by 64KB or after 100ms, and the file is rewritten
+// when it holds more than twice the pool plus JOURNAL_MIN_RECORDS
+#define JOURNAL_BUFF_MAX	65536
+#define JOURNAL_FLUSH_USEC	100000
+#define JOURNAL_MIN_RECORDS	65536
 
 // Define JOBTYPE
 #define JOBTYPE_WORKER		1
@@ -178,46 +470,163 @@ typedef std::map<int, miner_t>		minermap_t;
 
 #define DEFAULT_TRANS_PER_BLOCK	50000
 
+// Initial number of slots of a mempool table, and number of mempool shards
+#define MEMPOOL_MIN_SLOTS	64
+#define MEMPOOL_SHARDS		32
+
+// Default budget of transactions waiting in the mempool, 0 is unlimited
+#define DEFAULT_MEMPOOL_MAX	1000000
+
+// Outcome of a mempool admission
+#define TRANS_POOL_ADDED	0
+#define TRANS_POOL_EXISTS	1
+#define TRANS_POOL_EVICTED	2	// Added after evicting the oldest transaction of its shard
+#define TRANS_POOL_SHED		3	// Rejected, the transaction is the oldest of a full shard
+
+// Retargeting happens every RETARGET_INTERVAL blocks, by at most a factor RETARGET_CLAMP
+#define RETARGET_INTERVAL	16
+#define RETARGET_CLAMP		4
+
+// Mining engine limits: the top nonce byte holds the thread index
+#define MINER_MAX_THREADS	256
+#define MINER_NONCE_SHIFT	56
+#define MINER_POLL_USEC		1000
+#define HASHKERN_MAX_LANES	16
+#define HASHKERN_CALIBRATE	0.02
+
 // Macros
 #define FATAL(str) do { perror(str); exit(-1); } while (0)
 
 // Main functions 
 void		execute_bootstrap();
 void		execute_worker(unsigned int numtx, unsigned int difficulty, unsigned int numworkers, unsigned int numcores,
-			       std::list<int> ports);
+			       std::list<int> ports, minerconf_t minerconf, unsigned int maxpool, bool journal);
 void*		thread_start(void *null);
 void		thread_create();
 
 // Utilities
 char		*pack_sendport(bootmap_t portmap, int *len);
 void		pack_bootmsg(unsigned short port, bootmsg_t *msg);
+void		pack_blockhash(blockmsg_t *msg, unsigned char txroot[32], blockhash_t *data);
 int		sha256(unsigned char *buff, unsigned int len, unsigned char *output);
+void		sha256_midstate(unsigned char *prefix, unsigned int len, hashmid_t *midstate);
+void		sha256_finish(hashmid_t *midstate, unsigned char *tail, unsigned int len,
+			      unsigned char *output);
+bool		hash_check_target(unsigned char hash[32], unsigned char target[32]);
+void		target_from_bits(uint bits, unsigned char target[32]);
+uint		bits_from_target(unsigned char target[32]);
+uint		bits_from_difficulty(int difficulty);
+void		target_scale(unsigned char target[32], ullint mul, ullint div);
+void		sha256_init_state(unsigned int state[8]);
+void		sha256_compress(unsigned int state[8], unsigned char block[64]);
+hashkern_t	*hashkern_select(const char *name);
 void		sha256_mineraddr(unsigned char *output);
 char		*unpack_sendblock(char *buf, int len);
 char		*unpack_sendtransaction(char *buf, int len);
 std::string	hash_binary_to_string(unsigned char hash[32]);
 void		string_integer_increment(char *buff, int len);
 void		string_integer_decrement(char *buff, int len);
-void		string_sub(unsigned char sender_amt[32], unsigned char amt2sub[32], unsigned char *output);
-void		string_add(unsigned char sender_amt[32], unsigned char amt2sub[32], unsigned char *output);
+bool		amount_load(unsigned char digits[32], amount_t *value);
+void		amount_store(unsigned char digits[32], amount_t value);
+bool		amount_add(amount_t first, amount_t second, amount_t *output);
+bool		amount_sub(amount_t first, amount_t second, amount_t *output);
 bool		smaller_than(unsigned char first[32], unsigned char second[32]);
 void		wallet_print(const char *prefix, unsigned char sender[32],
 			     unsigned char amount[32], unsigned char receiver[32]);
 std::string	hash2str(unsigned char hash[32]);
 std::string	tag2str(unsigned char str[32]);
 bool		is_zero(unsigned char tag[32]);
+uint		be32_load(unsigned char *buff);
+void		be32_store(unsigned char *buff, uint val);
+ullint		be64_load(unsigned char *buff);
+void		be64_store(unsigned char *buff, ullint val);
 int		async_send(int fd, char *buff, int len, const char *errstr, bool verb);
 int		async_read(int fd, char *buff, int len, const char *errstr);
 void		worker_zero_state(worker_t& worker);
+void		UTXO_init();
 
 // Transaction related functions
 int		trans_sync(blocklist_t& added, blocklist_t& removed, unsigned int numtxinblock, bool store);
-bool		trans_exists(transmsg_t trans);
-int		trans_verify(worker_t *worker, transmsg_t trans, unsigned int numtxinblock, int difficulty);
-int		trans_exec(transdata_t *data, int numtxinblock, bool reverted);
+int		trans_verify(worker_t *worker, int sock, transmsg_t trans, unsigned int numtxinblock,
+			     int difficulty);
+int		trans_verify_batch(worker_t *worker, int sock, transdata_t *data, unsigned int count,
+				   unsigned int numtxinblock, int difficulty);
+void		trans_relay(transdata_t *data, unsigned int count);
+void		trans_relay_flush(bool force);
+void		trans_inv_receive(int sock, unsigned char *ports, unsigned int numports,
+				  unsigned char *ids, unsigned int count);
+void		trans_getdata_receive(int sock, unsigned char *ids, unsigned int count);
+int		trans_exec_threads(accountstate_t& state, transdata_t *data, int numtxinblock, bool revert,
+				   unsigned int numthreads, undolist_t *undo);
+int		trans_commit(transdata_t *data, int numtxinblock, unsigned char hash[32]);
+int		trans_commit_state(stateref_t& state, transdata_t *data, int numtxinblock, unsigned char hash[32]);
+int		trans_rollback_state(stateref_t& state, transdata_t *data, int numtxinblock, unsigned char hash[32]);
+void		trans_forget(blocklist_t& blocks);
+void		trans_undo(accountstate_t& state, undolist_t& undo);
+stateref_t	state_current();
+void		state_publish(stateref_t state);
+stateref_t	state_fork(stateref_t base);
+amount_t	account_balance(accountstate_t& state, uint idx);
+account_t&	account_write(accountstate_t& state, uint idx);
+int		account_find(unsigned char key[32]);
+uint		account_create(unsigned char key[32], amount_t amount);
+
+// Mempool table functions
+ullint		mempool_hash(transdata_t *data);
+transmsg_t	*mempool_find(mempool_t& pool, transdata_t *data);
+transmsg_t	*mempool_find_hash(mempool_t& pool, ullint hash);
+bool		mempool_insert(mempool_t& pool, transmsg_t& msg);
+bool		mempool_erase(mempool_t& pool, transdata_t *data);
+void		mempool_clear(mempool_t& pool);
+bool		mempool_past_find(mempoolpast_t& past, transdata_t *data, ullint hash);
+bool		mempool_past_find_hash(mempoolpast_t& past, ullint hash);
+void		mempool_past_insert(mempoolpast_t& past, transmsg_t& msg);
+void		mempool_past_clear(mempoolpast_t& past);
+
+// Sharded mempool helpers
+// The template lock protects the template order, its tree and the miner templates
+// It is always taken before shard locks, and shard locks in increasing order
+void		trans_pool_init(unsigned int maxpool, unsigned int numtxinblock);
+mempoolshard_t	*trans_pool_shard(transdata_t *data);
+void		trans_pool_lockall();
+void		trans_pool_unlockall();
+int		trans_pool_insert(transmsg_t& msg);
+void		trans_pool_stats();
+void		trans_pool_restore(transdata_t *data, unsigned int count);
+bool		trans_pool_past(transdata_t *data);
+void		trans_pool_rotate();
+void		trans_pool_expire(transmsg_t& msg);
+void		trans_pool_drain();
+bool		trans_spend_reserve(transdata_t *data, amount_t balance);
+void		trans_spend_release(transdata_t *data);
+void		trans_spend_recheck();
+void		trans_pool_rebuild();
+void		trans_pool_advance(unsigned int count);
+void		trans_pool_tree(unsigned int numleaves);
+
+// Mempool journal functions
+ullint		journal_load(const char *path, worker_t *worker, unsigned int numtxinblock,
+			     int difficulty);
+void		journal_append(transdata_t *data, unsigned int count);
+void		journal_flush(bool force);
+void		journal_compact(bool force);
+
+// Merkle tree functions
+void		merkle_clear(merkle_t& tree);
+void		merkle_append(merkle_t& tree, transdata_t *trans);
+void		merkle_build(merkle_t& tree, transdata_t *trans, unsigned int numtx);
+void		merkle_truncate(merkle_t& tree, ullint numleaves);
+bool		merkle_root(merkle_t& tree, unsigned int numleaves, unsigned char *output);
 
 // Mining related functions
+void		miner_init(minerconf_t conf);
+miner_t		*miner_register(worker_t *worker);
+void		miner_wake(worker_t *worker, int difficulty, int numtxinblock);
+minesession_t	*miner_session_create();
+void		miner_abort(miner_t& miner, unsigned int numtxinblock);
 int		do_mine(worker_t *worker, int difficulty, int numtxinblock);
+int		do_mine_hash(hashkern_t *kern, hashmid_t *midstate, unsigned char (*nonces)[32],
+			     unsigned char *target, unsigned char (*hashes)[32]);
 
 // Chain related functions
 bool		chain_propagate_only(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int port);
@@ -225,7 +634,12 @@ bool		chain_merge_deep(blockmsg_t msg, char *transdata, unsigned int numtxinbloc
 bool		chain_merge_single_block(blockmsg_t msg, char *transdata, unsigned int numtxinblock, block_t& top, int port);
 bool		chain_accept_block(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int port);
 bool		chain_sync(worker_t& worker, unsigned char expected_height[32]);
-bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int port);
+bool		chain_store(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int port, int difficulty);
+bool		chain_verify_block(blockmsg_t msg, char *transdata, unsigned int numtxinblock, int difficulty);
+uint		chain_next_bits(int difficulty);
+uint		chain_bits_after(blockmsg_t *parent, int difficulty, blocklist_t *pending);
+bool		chain_check_parent(blockmsg_t& msg, blockmsg_t *parent, int difficulty,
+				   blocklist_t *pending);
 bool		chain_merge_simple(blockmsg_t msg, char *transdata, unsigned int numtxinblock, block_t& top, int port);
 bool		chain_push_block(blockmsg_t msg, char *transdata, unsigned int numtxinblock, block_t& top, int port);
 
@@ -1,283 +1,1355 @@
 #include "node.h"
 
 extern clientmap_t	clientmap;
+extern workermap_t	workermap;
 extern UTXO		utxomap;
-extern mempool_t	transpool;
-extern mempool_t	past_transpool;
-extern pthread_mutex_t  transpool_lock;
+extern mempoolshard_t	transshards[MEMPOOL_SHARDS];
+extern std::atomic<ullint> transcount;
+extern unsigned int	transpast;
+extern unsigned int	execthreads;
+extern pthread_mutex_t	undo_lock;
+extern undomap_t	blockundo;
+extern std::deque<std::string> blockundoorder;
+extern statemap_t	blockstate;
+extern std::deque<std::string> blockstateorder;
+extern spendshard_t	transspends[MEMPOOL_SHARDS];
+extern pthread_mutex_t	relay_lock;
+extern std::vector<ullint> transrelay;
+extern ullint		transrelaystart;
+extern peerinvmap_t	transknown;
+extern std::map<int, int> transpeers;
+extern std::unordered_map<ullint, ullint> transwanted;
+extern ullint		transmax;
+extern std::atomic<ullint> transevicted;
+extern std::atomic<ullint> transshed;
+extern pthread_mutex_t  template_lock;
 extern blockchain_t	chain;
 extern blockmap_t	bmap;
 extern pthread_mutex_t  chain_lock;
+extern keylist_t	transorder;
+extern ullint		transorderhead;
+extern merkle_t		transtree;
 
-// Check if a transaction is already present in the mempool
-bool		trans_exists(worker_t *worker, transmsg_t trans)
+
+// Transactions allowed to wait in one shard, 0 for no limit
+static ullint	transcap = 0;
+
+
+// Initialize the locks of the mempool shards and split the budget between them
+// The budget always leaves room for two blocks so that mining never starves
+void		trans_pool_init(unsigned int maxpool, unsigned int numtxinblock)
 {
-  std::string	transkey;
+  for (unsigned int idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    {
+      pthread_mutex_init(&transshards[idx].lock, NULL);
+      pthread_mutex_init(&transspends[idx].lock, NULL);
+    }
+  if (maxpool != 0 && maxpool < 2 * numtxinblock)
+    maxpool = 2 * numtxinblock;
+  transmax = maxpool;
+  transcap = (maxpool + MEMPOOL_SHARDS - 1) / MEMPOOL_SHARDS;
+  std::cerr << "Mempool budget: " << transmax << " transactions ("
+	    << transmax * sizeof(mempoolslot_t) << " bytes)" << std::endl;
+}
 
-  pthread_mutex_lock(&transpool_lock);
-  
-  transkey = hash_binary_to_string(trans.data.sender) +
-    hash_binary_to_string(trans.data.receiver) +
-    hash_binary_to_string(trans.data.amount) +
-    hash_binary_to_string(trans.data.timestamp);
-  
-  if (transpool.find(transkey) == transpool.end() &&
-      worker->miner.pending.find(transkey) == worker->miner.pending.end() &&
-      past_transpool.find(transkey) == past_transpool.end())
+
+// Shard of the mempool holding transactions of hash id
+static mempoolshard_t	*trans_pool_shard_id(ullint id)
+{
+  return (&transshards[(id >> 48) % MEMPOOL_SHARDS]);
+}
+
+
+// Shard holding a transaction. High bits are used, low bits pick the slot inside the shard
+mempoolshard_t	*trans_pool_shard(transdata_t *data)
+{
+  return (trans_pool_shard_id(mempool_hash(data)));
+}
+
+
+// Take all shard locks for a bulk operation, in increasing order
+void		trans_pool_lockall()
+{
+  for (unsigned int idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    pthread_mutex_lock(&transshards[idx].lock);
+}
+
+
+void		trans_pool_unlockall()
+{
+  for (unsigned int idx = MEMPOOL_SHARDS; idx > 0; idx--)
+    pthread_mutex_unlock(&transshards[idx - 1].lock);
+}
+
+
+// Order of the age heap: the oldest timestamp comes first
+static bool	trans_age_after(const transdata_t& first, const transdata_t& second)
+{
+  return (memcmp(first.timestamp, second.timestamp, sizeof(first.timestamp)) > 0);
+}
+
+
+// Make room in a full shard for data by evicting its oldest transaction (shard lock held)
+// Return false when data is older than everything in the shard: data is the one to drop
+static bool	trans_pool_evict(mempoolshard_t *shard, transdata_t *data)
+{
+  std::vector<transdata_t>&	ages = shard->ages;
+
+  while (ages.empty() == false && mempool_find(shard->pool, &ages.front()) == NULL)
+    {
+      std::pop_heap(ages.begin(), ages.end(), trans_age_after);
+      ages.pop_back();
+    }
+  if (ages.empty() || trans_age_after(ages.front(), *data) == false)
+    return (false);
+  mempool_erase(shard->pool, &ages.front());
+  trans_spend_release(&ages.front());
+  std::pop_heap(ages.begin(), ages.end(), trans_age_after);
+  ages.pop_back();
+  transcount--;
+  transevicted++;
+  return (true);
+}
+
+
+// Admit a transaction into its shard (shard lock held)
+// It reaches the template order at the next drain. A full shard sheds its oldest transaction
+int		trans_pool_insert(transmsg_t& msg)
+{
+  mempoolshard_t	*shard = trans_pool_shard(&msg.data);
+  int			ret = TRANS_POOL_ADDED;
+
+  if (mempool_find(shard->taken, &msg.data) != NULL ||
+      mempool_find(shard->pool, &msg.data) != NULL)
+    return (TRANS_POOL_EXISTS);
+  if (transcap != 0 && shard->pool.count >= transcap)
+    {
+      if (trans_pool_evict(shard, &msg.data) == false)
+	{
+	  transshed++;
+	  return (TRANS_POOL_SHED);
+	}
+      ret = TRANS_POOL_EVICTED;
+    }
+  mempool_insert(shard->pool, msg);
+  shard->fresh.push_back(msg.data);
+  transcount++;
+
+  // Entries of transactions that left the pool are dropped once they outnumber the pool
+  if (transcap != 0)
+    {
+      if (shard->ages.size() > 2 * shard->pool.count + MEMPOOL_MIN_SLOTS)
+	{
+	  shard->ages.clear();
+	  for (ullint idx = 0; idx < shard->pool.slots.size(); idx++)
+	    if (shard->pool.slots[idx].hash != 0)
+	      shard->ages.push_back(shard->pool.slots[idx].msg.data);
+	  std::make_heap(shard->ages.begin(), shard->ages.end(), trans_age_after);
+	}
+      else
+	{
+	  shard->ages.push_back(msg.data);
+	  std::push_heap(shard->ages.begin(), shard->ages.end(), trans_age_after);
+	}
+    }
+  return (ret);
+}
+
+
+// Print occupancy and load shedding counters of the mempool
+void		trans_pool_stats()
+{
+  ullint	count = transcount.load();
+
+  std::cerr << "MEMPOOL:" << count << "," << count * sizeof(mempoolslot_t) << ","
+	    << transmax << "," << transevicted.load() << "," << transshed.load() << std::endl;
+}
+
+
+// Tell a transaction sender that the mempool is shedding load, at most once per second
+static void	trans_pool_signal(int sock)
+{
+  static std::atomic<time_t>	last(0);
+  char				c = OPCODE_POOLFULL;
+  time_t			now = time(NULL);
+
+  if (sock < 0 || last.exchange(now) == now)
+    return;
+  std::cerr << "Mempool is full - signaling sender on sock " << sock << std::endl;
+  async_send(sock, &c, 1, "Send pool full", false);
+}
+
+
+// Whether data belongs to one of the last blocks (shard lock held)
+static bool	trans_pool_inpast(mempoolshard_t *shard, transdata_t *data)
+{
+  ullint	hash = mempool_hash(data);
+
+  for (unsigned int idx = 0; idx < MEMPOOL_PAST_BLOCKS; idx++)
+    if (mempool_past_find(shard->past[idx], data, hash))
+      return (true);
+  return (false);
+}
+
+
+// Put back transactions taken by an aborted miner into the pool (all shards locked)
+// Their debits stay pending, unless a block committed them meanwhile or the pool is full
+void		trans_pool_restore(transdata_t *data, unsigned int count)
+{
+  for (unsigned int idx = 0; idx < count; idx++)
+    {
+      mempoolshard_t	*shard = trans_pool_shard(data + idx);
+      transmsg_t	msg;
+
+      mempool_erase(shard->taken, data + idx);
+      if (trans_pool_inpast(shard, data + idx))
+	{
+	  trans_spend_release(data + idx);
+	  continue;
+	}
+      msg.hdr.opcode = OPCODE_SENDTRANS;
+      msg.data = data[idx];
+      int ret = trans_pool_insert(msg);
+      if (ret != TRANS_POOL_ADDED && ret != TRANS_POOL_EVICTED)
+	trans_spend_release(data + idx);
+    }
+}
+
+
+// Check whether a transaction belongs to one of the last blocks
+bool		trans_pool_past(transdata_t *data)
+{
+  mempoolshard_t	*shard = trans_pool_shard(data);
+  bool			found;
+
+  pthread_mutex_lock(&shard->lock);
+  found = trans_pool_inpast(shard, data);
+  pthread_mutex_unlock(&shard->lock);
+  return (found);
+}
+
+
+// Start the past generation of a new block, forgetting the oldest one (all shard locks held)
+void		trans_pool_rotate()
+{
+  transpast = (transpast + 1) % MEMPOOL_PAST_BLOCKS;
+  for (unsigned int idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    mempool_past_clear(transshards[idx].past[transpast]);
+}
+
+
+// Record a transaction of the newest block as past (shard lock held)
+void		trans_pool_expire(transmsg_t& msg)
+{
+  mempoolshard_t	*shard = trans_pool_shard(&msg.data);
+
+  mempool_past_insert(shard->past[transpast], msg);
+}
+
+
+// Template order: by timestamp, then by content so that all nodes pick the same transactions
+static bool	trans_order_before(const transdata_t& first, const transdata_t& second)
+{
+  int		cmp = memcmp(first.timestamp, second.timestamp, sizeof(first.timestamp));
+
+  if (cmp != 0)
+    return (cmp < 0);
+  return (memcmp(&first, &second, sizeof(transdata_t)) < 0);
+}
+
+
+// Merge admissions of all shards into the template order (template lock held)
+// Each shard lock is taken once, only to grab its list. Late timestamps are the common case
+// and only extend the order, older ones cut the tree back to where they land
+void		trans_pool_drain()
+{
+  keylist_t	batch;
+  ullint	size = transorder.size();
+
+  for (unsigned int idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    {
+      mempoolshard_t	*shard = &transshards[idx];
+
+      pthread_mutex_lock(&shard->lock);
+      batch.insert(batch.end(), shard->fresh.begin(), shard->fresh.end());
+      shard->fresh.clear();
+      pthread_mutex_unlock(&shard->lock);
+    }
+  if (batch.empty())
+    return;
+  std::sort(batch.begin(), batch.end(), trans_order_before);
+
+  ullint first = std::upper_bound(transorder.begin() + transorderhead, transorder.end(), batch[0],
+				  trans_order_before) - transorder.begin();
+  transorder.insert(transorder.end(), batch.begin(), batch.end());
+  if (first < size)
+    std::inplace_merge(transorder.begin() + first, transorder.begin() + size,
+		       transorder.end(), trans_order_before);
+  merkle_truncate(transtree, first - transorderhead);
+}
+
+
+// Drop template order entries of transactions that left the pool, and those already taken
+// The tree is cut back to the first dropped entry. Called with the template lock and all shard locks held
+void		trans_pool_rebuild()
+{
+  ullint	kept = 0;
+  ullint	first = transorder.size() - transorderhead;
+
+  for (ullint idx = transorderhead; idx < transorder.size(); idx++)
+    {
+      transdata_t *cur = &transorder[idx];
+      if (mempool_find(trans_pool_shard(cur)->pool, cur) == NULL ||
+	  (kept != 0 && memcmp(&transorder[kept - 1], cur, sizeof(transdata_t)) == 0))
+	{
+	  first = std::min(first, idx - transorderhead);
+	  continue;
+	}
+      transorder[kept++] = *cur;
+    }
+  transorder.resize(kept);
+  transorderhead = 0;
+  merkle_truncate(transtree, first);
+}
+
+
+// Move the head of the template order past count entries taken into a template (template lock held)
+// Taken entries are only dropped once they make up half of the order, so that each entry is
+// shifted a bounded number of times rather than the whole order at every template
+void		trans_pool_advance(unsigned int count)
+{
+  transorderhead += count;
+  if (transorderhead * 2 < transorder.size())
+    return;
+  transorder.erase(transorder.begin(), transorder.begin() + transorderhead);
+  transorderhead = 0;
+}
+
+
+// Hash template order entries into the tree until it covers numleaves of them (template lock held)
+// Shard locks are not needed, so admissions go on while the next template is hashed in
+void		trans_pool_tree(unsigned int numleaves)
+{
+  ullint	count = transtree.levels.empty() ? 0 : transtree.levels[0].size();
+
+  for (; count < numleaves && transorderhead + count < transorder.size(); count++)
+    merkle_append(transtree, &transorder[transorderhead + count]);
+}
+
+
+// Shard of the pending debits of the sender of data
+static spendshard_t	*trans_spend_shard(transdata_t *data)
+{
+  return (&transspends[data->sender[31] % MEMPOOL_SHARDS]);
+}
+
+
+// Add the amount of data to the pending debits of its sender if the balance covers them all
+// Return false, leaving debits unchanged, when the transaction would overdraw the account
+bool		trans_spend_reserve(transdata_t *data, amount_t balance)
+{
+  spendshard_t	*shard = trans_spend_shard(data);
+  std::string	key((char *) data->sender, sizeof(data->sender));
+  account_t	total;
+
+  if (amount_load(data->amount, &total.amount) == false)
+    return (false);
+  pthread_mutex_lock(&shard->lock);
+  spendmap_t::iterator it = shard->debits.find(key);
+  if ((it != shard->debits.end() &&
+       amount_add(it->second.amount, total.amount, &total.amount) == false) ||
+      total.amount > balance)
     {
-      
-      pthread_mutex_unlock(&transpool_lock);
+      pthread_mutex_unlock(&shard->lock);
       return (false);
     }
+  shard->debits[key] = total;
+  pthread_mutex_unlock(&shard->lock);
+  return (true);
+}
+
+
+// Remove the amount of data from the pending debits of its sender
+// Accounts left with nothing pending are dropped so the index only holds active senders
+void		trans_spend_release(transdata_t *data)
+{
+  spendshard_t	*shard = trans_spend_shard(data);
+  std::string	key((char *) data->sender, sizeof(data->sender));
+  amount_t	amount;
 
-  pthread_mutex_unlock(&transpool_lock);
+  if (amount_load(data->amount, &amount) == false)
+    return;
+  pthread_mutex_lock(&shard->lock);
+  spendmap_t::iterator it = shard->debits.find(key);
+  if (it != shard->debits.end() &&
+      (amount_sub(it->second.amount, amount, &it->second.amount) == false || it->second.amount == 0))
+    shard->debits.erase(it);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+
+// Check that sender and receiver exist and that the sender can afford the amount
+// on top of its pending debits. The amount is then reserved until the transaction leaves the pool
+static bool	trans_check(transdata_t *data)
+{
+  int		sender = account_find(data->sender);
+
+  if (sender < 0)
+    {
+      std::cerr << "Received transaction with unknown sender - ignoring" << std::endl;
+      return (false);
+    }
+  if (account_find(data->receiver) < 0)
+    {
+      std::cerr << "Received transaction with unknown receiver - ignoring" << std::endl;
+      return (false);
+    }
+  if (trans_spend_reserve(data, account_balance(*state_current(), sender)) == false)
+    {
+      std::cerr << "Received transaction with bankrupt sender - ignoring" << std::endl;
+      return (false);
+    }
   return (true);
 }
 
 
+// Order of a batch by shard so that every shard lock is taken once
+static bool	trans_shard_before(const std::pair<unsigned int, transdata_t *>& first,
+				   const std::pair<unsigned int, transdata_t *>& second)
+{
+  return (first.first < second.first);
+}
+
+
 // Verify transaction and add it to the pool if correct
 int		trans_verify(worker_t *worker,
+			     int sock,
 			     transmsg_t trans,
 			     unsigned int numtxinblock,
 			     int difficulty)
 {
-  account_t	sender;
-  account_t	receiver;
+  return (trans_verify_batch(worker, sock, &trans.data, 1, numtxinblock, difficulty));
+}
+
+
+// Verify a batch of transactions and add the correct ones to the pool. Return the number added
+// Known transactions are dropped before account checks, then each shard is locked once to admit the rest
+int		trans_verify_batch(worker_t *worker,
+				   int sock,
+				   transdata_t *data,
+				   unsigned int count,
+				   unsigned int numtxinblock,
+				   int difficulty)
+{
+  std::vector<std::pair<unsigned int, transdata_t *> >	batch;
+  std::vector<transdata_t>				accepted;
+  bool							shedding = false;
+  unsigned int						idx;
+  unsigned int						cur;
+
+  //std::cerr << "VERIFYing " << count << " transactions" << std::endl;
 
-  //std::cerr << "VERIFYing transaction" << std::endl;
+  for (idx = 0; idx < count; idx++)
+    batch.push_back(std::make_pair(trans_pool_shard(data + idx) - transshards, data + idx));
+  std::stable_sort(batch.begin(), batch.end(), trans_shard_before);
 
-  if (trans_exists(worker, trans))
+  // Drop transactions that are already in mempool or in one of the last blocks
+  for (idx = 0, cur = 0; idx < batch.size(); )
     {
-      //std::cerr << "Transaction is already in mempool - ignoring" << std::endl;
-      return (0);
+      mempoolshard_t *shard = transshards + batch[idx].first;
+
+      pthread_mutex_lock(&shard->lock);
+      for (; idx < batch.size() && transshards + batch[idx].first == shard; idx++)
+	if (mempool_find(shard->pool, batch[idx].second) == NULL &&
+	    mempool_find(shard->taken, batch[idx].second) == NULL &&
+	    trans_pool_inpast(shard, batch[idx].second) == false)
+	  batch[cur++] = batch[idx];
+      pthread_mutex_unlock(&shard->lock);
     }
-  
-  std::string mykey = hash_binary_to_string(trans.data.sender);
-  if (utxomap.find(mykey) == utxomap.end())
+  batch.resize(cur);
+
+  for (idx = 0, cur = 0; idx < batch.size(); idx++)
+    if (trans_check(batch[idx].second))
+      batch[cur++] = batch[idx];
+  batch.resize(cur);
+
+  for (idx = 0; idx < batch.size(); )
     {
-      std::cerr << "Received transaction with unknown sender - ignoring" << std::endl;
-      return (0);
+      mempoolshard_t *shard = transshards + batch[idx].first;
+
+      pthread_mutex_lock(&shard->lock);
+      for (; idx < batch.size() && transshards + batch[idx].first == shard; idx++)
+	{
+	  transmsg_t	msg;
+
+	  msg.hdr.opcode = OPCODE_SENDTRANS;
+	  msg.data = *batch[idx].second;
+	  int ret = trans_pool_insert(msg);
+	  if (ret == TRANS_POOL_EVICTED || ret == TRANS_POOL_SHED)
+	    shedding = true;
+	  if (ret == TRANS_POOL_ADDED || ret == TRANS_POOL_EVICTED)
+	    accepted.push_back(msg.data);
+	  else
+	    trans_spend_release(&msg.data);
+	}
+      pthread_mutex_unlock(&shard->lock);
     }
-  //std::cerr << "Transaction has known sender - continuing" << std::endl;    
+
+  // Shedding load: the sender hears about it and dropped transactions are not relayed
+  if (shedding)
+    trans_pool_signal(sock);
+  if (accepted.empty())
+    return (0);
+
+  //std::cerr << "Added " << accepted.size() << " transactions to mempool" << std::endl;
+  trans_relay(accepted.data(), accepted.size());
+  journal_append(accepted.data(), accepted.size());
   
-  sender = utxomap[mykey];
-  mykey = hash_binary_to_string(trans.data.receiver);
-  if (utxomap.find(mykey) == utxomap.end())
+  // Start mining if transpool contains enough transactions to make a block
+  // A miner already running in this process picks them up by itself
+  // Mining happens on the executor so this job thread goes straight back to I/O
+  if (transcount.load() >= numtxinblock && worker->miner->session->running.load() == false)
     {
-      std::cerr << "Received transaction with unknown receiver - ignoring" << std::endl;
-      return (0);
+      std::cerr << "Block is FULL " << numtxinblock << " - starting miner" << std::endl;
+      miner_wake(worker, difficulty, numtxinblock);
     }
-  //std::cerr << "Transaction has known receiver - continuing" << std::endl;    
   
-  receiver = utxomap[mykey];
+  //else
+  //std::cerr << "Block is not FULL - keep listening" << std::endl;
+  
+  return (accepted.size());
+}
+
+
+// Microseconds on the monotonic clock
+static ullint	trans_relay_now()
+{
+  struct timespec	now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec * 1000000ULL + now.tv_nsec / 1000);
+}
+
+
+// Queue the ids of accepted transactions for all remotes. A full batch is announced right away
+void		trans_relay(transdata_t *data, unsigned int count)
+{
+  bool		full;
+
+  pthread_mutex_lock(&relay_lock);
+  if (transrelay.empty())
+    transrelaystart = trans_relay_now();
+  for (unsigned int idx = 0; idx < count; idx++)
+    transrelay.push_back(mempool_hash(data + idx));
+  full = (transrelay.size() >= TRANS_INV_MAX);
+  pthread_mutex_unlock(&relay_lock);
+  if (full)
+    trans_relay_flush(true);
+}
 
-  if (smaller_than(sender.amount, trans.data.amount))
+
+// Whether a peer is known to have id (relay lock held)
+static bool	trans_inv_known(peerinv_t& inv, ullint id)
+{
+  return (inv.known[0].count(id) != 0 || inv.known[1].count(id) != 0);
+}
+
+
+// Remember that a peer has id, dropping the older generation when the newer one is full
+static void	trans_inv_learn(peerinv_t& inv, ullint id)
+{
+  if (inv.known[0].size() >= TRANS_KNOWN_MAX)
     {
-      std::cerr << "Received transaction with bankrupt sender - ignoring" << std::endl;
-      return (0);
+      inv.known[1].swap(inv.known[0]);
+      inv.known[0].clear();
     }
+  inv.known[0].insert(id);
+}
 
-  std::string transkey = hash_binary_to_string(trans.data.sender) +
-    hash_binary_to_string(trans.data.receiver) +
-    hash_binary_to_string(trans.data.amount) +
-    hash_binary_to_string(trans.data.timestamp);
-  
-  //std::cerr << "Added transaction to mempool" << std::endl;
-  
-  // Send transaction to all remotes
+
+// Node of a remote listening port: the lowest port it announced, or the port itself (relay lock held)
+static int	trans_inv_peer(int port)
+{
+  std::map<int, int>::iterator it = transpeers.find(port);
+
+  return (it == transpeers.end() ? port : it->second);
+}
+
+
+// Message made of an opcode, optionally the listening ports of this node, a count and count ids
+static std::string	trans_inv_message(char opcode, bool ports, ullint *ids, unsigned int count)
+{
+  std::string		msg(1, opcode);
+  unsigned char		buff[8];
+
+  if (ports)
+    {
+      be32_store(buff, workermap.size());
+      msg.append((char *) buff, 4);
+      for (workermap_t::iterator it = workermap.begin(); it != workermap.end(); it++)
+	{
+	  be32_store(buff, it->first);
+	  msg.append((char *) buff, 4);
+	}
+    }
+  be32_store(buff, count);
+  msg.append((char *) buff, 4);
+  for (unsigned int idx = 0; idx < count; idx++)
+    {
+      be64_store(buff, ids[idx]);
+      msg.append((char *) buff, 8);
+    }
+  return (msg);
+}
+
+
+// Announce queued transaction ids to all remote nodes that are not known to have them
+// A node listening on several ports shares one pool: it is announced to once, on its first port
+// Without force, nothing is sent until the oldest queued id waited TRANS_RELAY_USEC
+void		trans_relay_flush(bool force)
+{
+  std::vector<ullint>				pending;
+  std::vector<std::pair<int, std::string> >	msgs;
+  std::unordered_set<int>			peers;
+
+  pthread_mutex_lock(&relay_lock);
+  if (transrelay.empty() ||
+      (force == false && trans_relay_now() - transrelaystart < TRANS_RELAY_USEC))
+    {
+      pthread_mutex_unlock(&relay_lock);
+      return;
+    }
+  pending.swap(transrelay);
   for (clientmap_t::iterator it = clientmap.begin(); it != clientmap.end(); it++)
     {
-      remote_t remote = it->second;
+      int			peer = trans_inv_peer(it->second.remote_port);
+      std::vector<ullint>	ids;
 
-      async_send(remote.client_sock, (char *) &trans,
-		 sizeof(transmsg_t), "Send transaction on remote", false);
-      
-      //std::cerr << "Sent transaction to remote port " << remote.remote_port << std::endl;
+      if (peers.insert(peer).second == false)
+	continue;
+      peerinv_t&		inv = transknown[peer];
+      for (ullint idx = 0; idx < pending.size(); idx++)
+	if (trans_inv_known(inv, pending[idx]) == false)
+	  {
+	    trans_inv_learn(inv, pending[idx]);
+	    ids.push_back(pending[idx]);
+	  }
+      for (ullint off = 0; off < ids.size(); off += TRANS_INV_MAX)
+	msgs.push_back(std::make_pair(it->second.client_sock,
+				      trans_inv_message(OPCODE_INV, true, ids.data() + off,
+							std::min(ids.size() - off, (ullint) TRANS_INV_MAX))));
     }
+  pthread_mutex_unlock(&relay_lock);
 
-  pthread_mutex_lock(&transpool_lock);
-  transpool[transkey] = trans;
-  pthread_mutex_unlock(&transpool_lock);
-  
-  // Start mining if transpool contains enough transactions to make a block
-  if (transpool.size() == numtxinblock)
+  // Send announcements to all remotes
+  for (ullint idx = 0; idx < msgs.size(); idx++)
+    async_send(msgs[idx].first, (char *) msgs[idx].second.data(), msgs[idx].second.size(),
+	       "Send transaction inventory on remote", false);
+}
+
+
+// Whether a transaction of hash id is in the mempool, in a template or in one of the last blocks
+static bool	trans_pool_known(ullint id)
+{
+  mempoolshard_t	*shard = trans_pool_shard_id(id);
+  bool			found = false;
+
+  pthread_mutex_lock(&shard->lock);
+  if (mempool_find_hash(shard->pool, id) != NULL || mempool_find_hash(shard->taken, id) != NULL)
+    found = true;
+  for (unsigned int idx = 0; found == false && idx < MEMPOOL_PAST_BLOCKS; idx++)
+    found = mempool_past_find_hash(shard->past[idx], id);
+  pthread_mutex_unlock(&shard->lock);
+  return (found);
+}
+
+
+// Ids announced by the node listening on ports: request those we lack and did not ask for lately
+// The ids are known by that node, keyed by its lowest port whichever of its ports we later relay to
+void		trans_inv_receive(int sock, unsigned char *ports, unsigned int numports,
+				  unsigned char *ids, unsigned int count)
+{
+  std::vector<ullint>	wanted;
+  ullint		now = trans_relay_now();
+  int			peer = be32_load(ports);
+  unsigned int		idx;
+
+  for (idx = 0; idx < count; idx++)
     {
-      std::cerr << "Block is FULL " << numtxinblock << " - starting miner" << std::endl;
-      do_mine(worker, difficulty, numtxinblock);
+      ullint id = be64_load(ids + idx * 8);
+      if (trans_pool_known(id) == false)
+	wanted.push_back(id);
     }
-  
-  //else
-  //std::cerr << "Block is not FULL - keep listening" << std::endl;
-  
-  return (0);      
+  for (idx = 1; idx < numports; idx++)
+    peer = std::min(peer, (int) be32_load(ports + idx * 4));
+
+  pthread_mutex_lock(&relay_lock);
+  for (idx = 0; idx < numports; idx++)
+    transpeers[be32_load(ports + idx * 4)] = peer;
+  peerinv_t& inv = transknown[peer];
+  for (idx = 0; idx < count; idx++)
+    trans_inv_learn(inv, be64_load(ids + idx * 8));
+
+  // Requests that got no answer in time are forgotten so that another peer can be asked
+  if (transwanted.size() >= TRANS_KNOWN_MAX)
+    {
+      std::unordered_map<ullint, ullint>::iterator it = transwanted.begin();
+      while (it != transwanted.end())
+	if (now - it->second >= TRANS_GETDATA_USEC)
+	  it = transwanted.erase(it);
+	else
+	  it++;
+    }
+  unsigned int kept = 0;
+  for (idx = 0; idx < wanted.size(); idx++)
+    {
+      std::unordered_map<ullint, ullint>::iterator it = transwanted.find(wanted[idx]);
+      if (it != transwanted.end() && now - it->second < TRANS_GETDATA_USEC)
+	continue;
+      transwanted[wanted[idx]] = now;
+      wanted[kept++] = wanted[idx];
+    }
+  wanted.resize(kept);
+  pthread_mutex_unlock(&relay_lock);
+
+  if (wanted.empty())
+    return;
+  std::string msg = trans_inv_message(OPCODE_GETDATA, false, wanted.data(), wanted.size());
+  async_send(sock, (char *) msg.data(), msg.size(), "Send transaction request", false);
 }
 
 
-// Remove all duplicate transactions from the current pool after a chain syncing
-// Input: The list of blocks that were pushed on the chain and  the list that was removed
-// Return: The number of duplicate transactions removed from the pool
-int		trans_sync(blocklist_t& added, blocklist_t& removed, unsigned int numtxinblock, bool store)
+// Ids requested by a peer: send the transactions we still have as SENDTRANSBATCH messages
+void		trans_getdata_receive(int sock, unsigned char *ids, unsigned int count)
 {
-  unsigned int	nbr;
+  keylist_t	found;
 
-  std::cerr << "TRANS SYNC with " << added.size() << " added blocks and " << removed.size() << " removed blocks " << std::endl;
-  
-  // Go over the removed blocks and revert all transactions
+  for (unsigned int idx = 0; idx < count; idx++)
+    {
+      ullint		id = be64_load(ids + idx * 8);
+      mempoolshard_t	*shard = trans_pool_shard_id(id);
+
+      pthread_mutex_lock(&shard->lock);
+      transmsg_t *msg = mempool_find_hash(shard->pool, id);
+      if (msg == NULL)
+	msg = mempool_find_hash(shard->taken, id);
+      if (msg != NULL)
+	found.push_back(msg->data);
+      pthread_mutex_unlock(&shard->lock);
+    }
+
+  for (ullint off = 0; off < found.size(); off += TRANS_BATCH_MAX)
+    {
+      unsigned int	num = std::min(found.size() - off, (ullint) TRANS_BATCH_MAX);
+      std::string	msg(1, OPCODE_SENDTRANSBATCH);
+      unsigned char	countbuf[4];
+
+      be32_store(countbuf, num);
+      msg.append((char *) countbuf, sizeof(countbuf));
+      msg.append((char *) (found.data() + off), num * sizeof(transdata_t));
+      async_send(sock, (char *) msg.data(), msg.size(), "Send requested transactions", false);
+    }
+}
+
+
+// Recompute the pending debits of all senders against the published state (all shard locks held)
+// Transactions taken into templates keep theirs whatever the balance, their block is checked
+// when it is committed. Pool transactions are reserved again oldest first, and those the
+// balances no longer cover leave the pool
+void		trans_spend_recheck()
+{
+  stateref_t	state = state_current();
+  keylist_t	pending;
+  ullint	dropped = 0;
+  unsigned int	idx;
+
+  for (idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    {
+      pthread_mutex_lock(&transspends[idx].lock);
+      transspends[idx].debits.clear();
+      pthread_mutex_unlock(&transspends[idx].lock);
+    }
+  for (idx = 0; idx < MEMPOOL_SHARDS; idx++)
+    {
+      mempoolshard_t	*shard = &transshards[idx];
+
+      for (ullint slot = 0; slot < shard->taken.slots.size(); slot++)
+	if (shard->taken.slots[slot].hash != 0)
+	  trans_spend_reserve(&shard->taken.slots[slot].msg.data, AMOUNT_MAX);
+      for (ullint slot = 0; slot < shard->pool.slots.size(); slot++)
+	if (shard->pool.slots[slot].hash != 0)
+	  pending.push_back(shard->pool.slots[slot].msg.data);
+    }
+  std::sort(pending.begin(), pending.end(), trans_order_before);
+  for (ullint pos = 0; pos < pending.size(); pos++)
+    {
+      int	sender = account_find(pending[pos].sender);
+
+      if (sender >= 0 && trans_spend_reserve(&pending[pos], account_balance(*state, sender)))
+	continue;
+      mempool_erase(trans_pool_shard(&pending[pos])->pool, &pending[pos]);
+      transcount--;
+      dropped++;
+    }
+  if (dropped != 0)
+    std::cerr << "Dropped " << dropped << " pool transactions the balances no longer cover" << std::endl;
+}
+
+
+// Reconcile the pool with a reorg in one locked pass (template order holes are dropped at the next template)
+// Transactions of removed blocks come back unless an added block commits them again or the new
+// state no longer affords them, so that blocks mined from the pool still apply whole. Those of
+// added blocks leave the pool and fill one past generation per block. Shards and the committed
+// set are computed before locking, so the locked merge only touches the tables
+// A reorg can lower balances that pending debits were checked against: they are all checked again
+static void	trans_sync_pool(blocklist_t& added, blocklist_t& removed, unsigned int numtxinblock)
+{
+  std::vector<transdata_t *>				restore[MEMPOOL_SHARDS];
+  std::vector<std::pair<unsigned int, transdata_t *> >	commit[MEMPOOL_SHARDS];
+  mempool_t						committed;
+  keylist_t						restored;
+  unsigned int						numblocks = 0;
+  unsigned int						idx;
+
+  for (blocklist_t::iterator it = added.begin(); it != added.end(); it++, numblocks++)
+    for (idx = 0; idx < numtxinblock; idx++)
+      {
+	transdata_t	*data = it->trans + idx;
+
+	commit[trans_pool_shard(data) - transshards].push_back(std::make_pair(numblocks, data));
+	if (removed.empty() == false)
+	  {
+	    transmsg_t	msg;
+
+	    msg.hdr.opcode = OPCODE_SENDTRANS;
+	    msg.data = *data;
+	    mempool_insert(committed, msg);
+	  }
+      }
   for (blocklist_t::iterator it = removed.begin(); it != removed.end(); it++)
+    for (idx = 0; idx < numtxinblock; idx++)
+      if (mempool_find(committed, it->trans + idx) == NULL)
+	restore[trans_pool_shard(it->trans + idx) - transshards].push_back(it->trans + idx);
+
+  trans_pool_lockall();
+
+  // Removed blocks own the newest past generations: forget them, then open one per added block
+  for (idx = 0; idx < removed.size() && idx < MEMPOOL_PAST_BLOCKS; idx++)
     {
-      block_t curblock = *it;
-	  
-      // True == revert
-      nbr = trans_exec(curblock.trans, numtxinblock, true);
-      if (nbr != numtxinblock)
-	std::cerr << "NOTE: Unable to revert all transactions from removed block" << std::endl;
-      
-      for (unsigned int idx = 0; idx < numtxinblock; idx++)
+      for (unsigned int sh = 0; sh < MEMPOOL_SHARDS; sh++)
+	mempool_past_clear(transshards[sh].past[transpast]);
+      transpast = (transpast + MEMPOOL_PAST_BLOCKS - 1) % MEMPOOL_PAST_BLOCKS;
+    }
+  for (idx = 0; idx < numblocks && idx < MEMPOOL_PAST_BLOCKS; idx++)
+    trans_pool_rotate();
+
+  for (unsigned int sh = 0; sh < MEMPOOL_SHARDS; sh++)
+    {
+      mempoolshard_t	*shard = &transshards[sh];
+
+      for (idx = 0; idx < restore[sh].size(); idx++)
 	{
-	  transdata_t *curdata = curblock.trans + idx;
-	  transmsg_t  msg;
-	  std::string transkey = hash_binary_to_string(curdata->sender) +
-	    hash_binary_to_string(curdata->receiver) +
-	    hash_binary_to_string(curdata->amount) +
-	    hash_binary_to_string(curdata->timestamp);
+	  transmsg_t	msg;
 
-	  // If this is not already in the transpool, add it back
-	  pthread_mutex_lock(&transpool_lock);
+	  msg.hdr.opcode = OPCODE_SENDTRANS;
+	  msg.data = *restore[sh][idx];
+	  if (trans_check(&msg.data) == false)
+	    continue;
+	  int ret = trans_pool_insert(msg);
+	  if (ret == TRANS_POOL_ADDED || ret == TRANS_POOL_EVICTED)
+	    restored.push_back(msg.data);
+	  else
+	    trans_spend_release(&msg.data);
+	}
+      for (idx = 0; idx < commit[sh].size(); idx++)
+	{
+	  unsigned int	age = numblocks - 1 - commit[sh][idx].first;
+	  transmsg_t	msg;
 
-	  if (transpool.find(transkey) == transpool.end())
+	  msg.hdr.opcode = OPCODE_SENDTRANS;
+	  msg.data = *commit[sh][idx].second;
+	  if (mempool_erase(shard->pool, &msg.data))
 	    {
-	      msg.hdr.opcode = OPCODE_SENDTRANS;
-	      msg.data = *curdata;
-	      transpool[transkey] = msg;
+	      transcount--;
+	      trans_spend_release(&msg.data);
 	    }
-	  pthread_mutex_unlock(&transpool_lock);	  
+	  if (age < MEMPOOL_PAST_BLOCKS)
+	    mempool_past_insert(shard->past[(transpast + MEMPOOL_PAST_BLOCKS - age) % MEMPOOL_PAST_BLOCKS], msg);
 	}
     }
+  if (removed.empty() == false)
+    trans_spend_recheck();
+  trans_pool_unlockall();
+  if (restored.empty() == false)
+    journal_append(restored.data(), restored.size());
+}
+
+
+// Bring accounts and the pool to the new chain state after a chain syncing
+// Input: The list of blocks that were pushed on the chain and  the list that was removed
+// Accounts are rolled back then executed block by block on a fork of the state, published at the end
+// The pool is reconciled once for the whole reorg
+// Return -1, leaving accounts, pool and chain untouched, if a block of the branch does not apply whole
+int		trans_sync(blocklist_t& added, blocklist_t& removed, unsigned int numtxinblock, bool store)
+{
+  unsigned int	nbr = numtxinblock;
+
+  stateref_t	state = state_current();
+
+  std::cerr << "TRANS SYNC with " << added.size() << " added blocks and " << removed.size() << " removed blocks " << std::endl;
+  
+  // Go over the removed blocks, newest first, and roll them back
+  for (blocklist_t::reverse_iterator it = removed.rbegin(); it != removed.rend() && nbr == numtxinblock; it++)
+    {
+      nbr = trans_rollback_state(state, it->trans, numtxinblock, it->hdr.hash);
+      if (nbr != numtxinblock)
+	std::cerr << "NOTE: Unable to revert all transactions from removed block" << std::endl;
+    }
   
   // Go over the added blocks and execute transactions
-  for (blocklist_t::iterator it = added.begin(); it != added.end(); it++)
+  for (blocklist_t::iterator it = added.begin(); it != added.end() && nbr == numtxinblock; it++)
     {
-      block_t& curblock = *it;
-      // Execute all transactions of the block 
-      nbr = trans_exec(curblock.trans, numtxinblock, false);
+      nbr = trans_commit_state(state, it->trans, numtxinblock, it->hdr.hash);
       if (nbr != numtxinblock)
 	std::cerr << "NOTE: Unable to exec all transactions from added block" << std::endl;
-	      
-      // Remove all executed transactions from transpool, put them in the past pool
-      for (unsigned int idx = 0; idx < numtxinblock; idx++)
-	{
-	  transdata_t *curdata = curblock.trans + idx;
-	  transmsg_t  msg;
-	  std::string transkey = hash_binary_to_string(curdata->sender) +
-	    hash_binary_to_string(curdata->receiver) +
-	    hash_binary_to_string(curdata->amount) +
-	    hash_binary_to_string(curdata->timestamp);
-
-	  // Remove all duplicate transactions from the transpool
-	  pthread_mutex_lock(&transpool_lock);
-	  if (transpool.find(transkey) != transpool.end())
-	    {
-	      msg = transpool[transkey];
-	      transpool.erase(transkey);
-	      past_transpool[transkey] = msg;
-	    }
-	  else
-	    {
-	      msg.hdr.opcode = OPCODE_SENDTRANS;
-	      msg.data = *curdata;
-	      past_transpool[transkey] = msg;
-	    }
-	  pthread_mutex_unlock(&transpool_lock);
+    }
 
-	  // Add block to map and chain
-	  if (store)
-	    {
-	      chain.push(curblock);
-	      std::string height = tag2str(curblock.hdr.height);
-	      bmap[height] = curblock;
-	    }
-	  
-	}
+  // The branch was evaluated on a fork of the state: drop it or switch to it at once
+  if (nbr != numtxinblock)
+    {
+      std::cerr << "Branch does not apply to the accounts - keeping the current chain" << std::endl;
+      trans_forget(added);
+      return (-1);
     }
+  state_publish(state);
+  trans_forget(removed);
+
+  trans_sync_pool(added, removed, numtxinblock);
+
+  // Add each block to map and chain once
+  if (store)
+    for (blocklist_t::iterator it = added.begin(); it != added.end(); it++)
+      {
+	chain.push(*it);
+	bmap[tag2str(it->hdr.height)] = *it;
+      }
   
-  std::cerr << "Trans_sync success: transpool size = " << transpool.size()
-	    << " past_transpool size = " << past_transpool.size() << std::endl;
+  std::cerr << "Trans_sync success: transpool size = " << transcount.load() << std::endl;
+  trans_pool_stats();
+  journal_compact(false);
   
   return (0);
 }
 
 
-// Execute all transactions of a block
-// Input: transaction data
-// Output: Number of transactions executed
-int		trans_exec(transdata_t *data, int numtxinblock, bool revert)
+// Published version of the account state
+stateref_t	state_current()
+{
+  return (std::atomic_load(&utxomap.current));
+}
+
+
+// Make a version the published one. Readers holding the previous one keep it intact
+void		state_publish(stateref_t state)
+{
+  std::atomic_store(&utxomap.current, state);
+}
+
+
+// New version sharing all pages of base until written
+stateref_t	state_fork(stateref_t base)
+{
+  return (std::make_shared<accountstate_t>(*base));
+}
+
+
+// Balance of account idx in a version
+amount_t	account_balance(accountstate_t& state, uint idx)
+{
+  return (state.pages[idx / ACCOUNT_PAGE_SIZE]->accounts[idx % ACCOUNT_PAGE_SIZE].amount);
+}
+
+
+// Account idx of a version for writing. Its page is copied first if another version shares it
+account_t&	account_write(accountstate_t& state, uint idx)
+{
+  std::shared_ptr<accountpage_t>&	page = state.pages[idx / ACCOUNT_PAGE_SIZE];
+
+  if (page.use_count() > 1)
+    page = std::make_shared<accountpage_t>(*page);
+  return (page->accounts[idx % ACCOUNT_PAGE_SIZE]);
+}
+
+
+// Index of the account of a 32 bytes binary key, or -1 if there is none
+int		account_find(unsigned char key[32])
+{
+  hashval_t	keyval;
+
+  memcpy(keyval.hash, key, sizeof(keyval.hash));
+  accountindex_t::iterator it = utxomap.index.find(keyval);
+  if (it == utxomap.index.end())
+    return (-1);
+  return (it->second);
+}
+
+
+// Add an account to the published state, or set the balance of an existing one. Return its index
+// This writes the published version in place, so it only runs before blocks are executed
+uint		account_create(unsigned char key[32], amount_t amount)
+{
+  hashval_t	keyval;
+
+  if (utxomap.current == NULL)
+    {
+      utxomap.current = std::make_shared<accountstate_t>();
+      utxomap.current->count = 0;
+    }
+
+  accountstate_t&	state = *utxomap.current;
+  memcpy(keyval.hash, key, sizeof(keyval.hash));
+  accountindex_t::iterator it = utxomap.index.find(keyval);
+  if (it != utxomap.index.end())
+    {
+      account_write(state, it->second).amount = amount;
+      return (it->second);
+    }
+
+  if (state.count % ACCOUNT_PAGE_SIZE == 0)
+    state.pages.push_back(std::make_shared<accountpage_t>());
+  account_write(state, state.count).amount = amount;
+  utxomap.index[keyval] = state.count;
+  return (state.count++);
+}
+
+
+// Apply transaction idx of a block whose accounts are resolved in parties
+// A transfer that would overdraw an account or overflow a balance is skipped
+// Return true if the transaction was executed
+static bool	trans_exec_one(accountstate_t& state, transdata_t *data, int *parties, int idx, bool revert)
+{
+  int		from = parties[2 * idx];
+  int		to = parties[2 * idx + 1];
+  amount_t	amount;
+
+  // Verify that the sender exists
+  if (from < 0)
+    {
+      std::cerr << "Failed to find wallet by sender key - bad key encoding?" << std::endl;
+      return (false);
+    }
+
+  // Verify that the receiver exists
+  if (to < 0)
+    {
+      std::cerr << "Failed to find wallet by receiver key - bad key encoding?" << std::endl;
+      return (false);
+    }
+
+  if (revert)
+    std::swap(from, to);
+
+  // The debit is taken back if the credit does not fit
+  account_t&	sender = account_write(state, from);
+  account_t&	receiver = account_write(state, to);
+  if (amount_load(data[idx].amount, &amount) == false ||
+      amount_sub(sender.amount, amount, &sender.amount) == false)
+    {
+      std::cerr << "Transaction amount is invalid or does not fit the balances - skipped" << std::endl;
+      return (false);
+    }
+  if (amount_add(receiver.amount, amount, &receiver.amount) == false)
+    {
+      sender.amount += amount;
+      std::cerr << "Transaction amount is invalid or does not fit the balances - skipped" << std::endl;
+      return (false);
+    }
+  return (true);
+}
+
+
+// Execute the transactions of one slot
+static void	*trans_exec_thread(void *arg)
+{
+  execslot_t	*slot = (execslot_t *) arg;
+
+  slot->executed = 0;
+  for (ullint idx = 0; idx < slot->txs.size(); idx++)
+    if (trans_exec_one(*slot->state, slot->data, slot->parties, slot->txs[idx], slot->revert))
+      slot->executed++;
+  return (NULL);
+}
+
+
+// Root of an account in the forest of connected accounts, halving the path on the way
+static int	trans_exec_root(std::vector<int>& parent, int idx)
+{
+  while (parent[idx] != idx)
+    {
+      parent[idx] = parent[parent[idx]];
+      idx = parent[idx];
+    }
+  return (idx);
+}
+
+
+// Put back the balances recorded in an undo journal
+void		trans_undo(accountstate_t& state, undolist_t& undo)
+{
+  for (ullint idx = 0; idx < undo.size(); idx++)
+    account_write(state, undo[idx].account).amount = undo[idx].amount;
+}
+
+
+// Keep a journal or snapshot of a block, dropping the oldest beyond max (undo lock held)
+template <typename T>
+static void	trans_keep(std::map<std::string, T>& blocks, std::deque<std::string>& order,
+			   std::string& key, T& value, unsigned int max)
+{
+  if (blocks.find(key) == blocks.end())
+    order.push_back(key);
+  blocks[key] = value;
+  while (order.size() > max)
+    {
+      blocks.erase(order.front());
+      order.pop_front();
+    }
+}
+
+
+// Find the journal or snapshot of a block among the kept ones (undo lock held)
+template <typename T>
+static bool	trans_find(std::map<std::string, T>& blocks, std::string& key, T& value)
+{
+  typename std::map<std::string, T>::iterator it = blocks.find(key);
+  if (it == blocks.end())
+    return (false);
+  value = it->second;
+  return (true);
+}
+
+
+// Drop the journal or snapshot of a block from the kept ones (undo lock held)
+template <typename T>
+static void	trans_drop(std::map<std::string, T>& blocks, std::deque<std::string>& order,
+			   std::string& key)
+{
+  if (blocks.erase(key) != 0)
+    order.erase(std::find(order.begin(), order.end(), key));
+}
+
+
+// Drop the journals and snapshots of blocks that are not on the chain anymore
+void		trans_forget(blocklist_t& blocks)
+{
+  pthread_mutex_lock(&undo_lock);
+  for (blocklist_t::iterator it = blocks.begin(); it != blocks.end(); it++)
+    {
+      std::string key((char *) it->hdr.hash, 32);
+      trans_drop(blockundo, blockundoorder, key);
+      trans_drop(blockstate, blockstateorder, key);
+    }
+  pthread_mutex_unlock(&undo_lock);
+}
+
+
+// Execute the transactions of a block added to the chain on a fork of state, which becomes state
+// The undo journal of the block and the version before it are kept for rollbacks
+int		trans_commit_state(stateref_t& state, transdata_t *data, int numtxinblock,
+				   unsigned char hash[32])
+{
+  std::string	key((char *) hash, 32);
+  stateref_t	after = state_fork(state);
+  undolist_t	undo;
+  int		nbr;
+
+  nbr = trans_exec_threads(*after, data, numtxinblock, false, execthreads, &undo);
+  pthread_mutex_lock(&undo_lock);
+  trans_keep(blockundo, blockundoorder, key, undo, UNDO_BLOCKS_MAX);
+  trans_keep(blockstate, blockstateorder, key, state, STATE_SNAPSHOTS_MAX);
+  pthread_mutex_unlock(&undo_lock);
+  state = after;
+  return (nbr);
+}
+
+
+// Execute the transactions of a block added to the chain and publish the new state
+// A block that does not apply whole leaves the published state untouched and is forgotten
+int		trans_commit(transdata_t *data, int numtxinblock, unsigned char hash[32])
 {
-  int		idx;
+  stateref_t	state = state_current();
   int		nbr;
 
+  nbr = trans_commit_state(state, data, numtxinblock, hash);
+  if (nbr != numtxinblock)
+    {
+      blocklist_t	blocks(1);
+
+      memcpy(blocks.front().hdr.hash, hash, sizeof(blocks.front().hdr.hash));
+      trans_forget(blocks);
+      return (nbr);
+    }
+  state_publish(state);
+  return (nbr);
+}
+
+
+// Undo the transactions of a block removed from the chain, state becoming the version before it
+// A kept snapshot is taken as is. Otherwise the journal is replayed on a fork, at the cost of
+// the accounts it touched only, and older blocks are reverted by executing them backwards
+// Both stay kept until the caller knows whether the block really leaves the chain
+// Return the number of transactions undone
+int		trans_rollback_state(stateref_t& state, transdata_t *data, int numtxinblock,
+				     unsigned char hash[32])
+{
+  std::string	key((char *) hash, 32);
+  stateref_t	before;
+  undolist_t	undo;
+  bool		snapshot;
+  bool		journal;
+
+  pthread_mutex_lock(&undo_lock);
+  snapshot = trans_find(blockstate, key, before);
+  journal = trans_find(blockundo, key, undo);
+  pthread_mutex_unlock(&undo_lock);
+  if (snapshot)
+    {
+      std::cerr << "Roll back block to its state snapshot" << std::endl;
+      state = before;
+      return (numtxinblock);
+    }
+
+  state = state_fork(state);
+  if (journal == false)
+    return (trans_exec_threads(*state, data, numtxinblock, true, execthreads, NULL));
+  std::cerr << "Roll back block with undo journal of " << undo.size() << " accounts" << std::endl;
+  trans_undo(*state, undo);
+  return (numtxinblock);
+}
+
+
+// Execute all transactions of a block on up to numthreads threads
+// Keys are resolved to account indexes first, then transfers only touch the account table
+// Transactions sharing an account, even through others, form a group that runs in block order
+// on one thread. Groups touch disjoint accounts, so the outcome is the one of the serial order
+// Reverting walks the block backwards so that it undoes transfers in the opposite order
+// With undo, the balances of all accounts of the block are recorded first
+// state must not be published yet: it is written in place, apart from pages shared with others
+int		trans_exec_threads(accountstate_t& state, transdata_t *data, int numtxinblock, bool revert,
+				   unsigned int numthreads, undolist_t *undo)
+{
+  std::vector<int>	parties(2 * numtxinblock);
+  int			idx;
+  int			nbr = 0;
+
   std::cerr << "Execute all transactions in block (reverted = " << revert << ")" << std::endl;
-  
-  // Update wallets amount values
-  for (nbr = idx = 0; idx < numtxinblock; idx++)
+
+  for (idx = 0; idx < numtxinblock; idx++)
     {
-      transdata_t *curtrans = &((transdata_t *) data)[idx];
-      std::string sender_key = hash_binary_to_string(curtrans->sender);
-      std::string receiver_key = hash_binary_to_string(curtrans->receiver);
+      parties[2 * idx] = account_find(data[idx].sender);
+      parties[2 * idx + 1] = account_find(data[idx].receiver);
+    }
 
-      // Verify that the sender exists
-      if (utxomap.find(sender_key) == utxomap.end())
-	{
-	  std::cerr << "Failed to find wallet by sender key - bad key encoding?" << std::endl;
-	  continue;
-	}
+  // Record the balances of touched accounts before any transfer
+  if (undo != NULL)
+    {
+      std::vector<int> touched(parties);
 
-      // Verify that the receiver exists
-      if (utxomap.find(receiver_key) == utxomap.end())
-	{
-	  std::cerr << "Failed to find wallet by receiver key - bad key encoding?" << std::endl;
-	  continue;
-	}
+      std::sort(touched.begin(), touched.end());
+      touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+      undo->clear();
+      for (ullint cur = 0; cur < touched.size(); cur++)
+	if (touched[cur] >= 0)
+	  {
+	    accountundo_t	entry;
 
-      //std::cerr << "Both sender and receiver are valid" << std::endl;
-      
-      account_t sender;
-      account_t receiver;
+	    entry.account = touched[cur];
+	    entry.amount = account_balance(state, touched[cur]);
+	    undo->push_back(entry);
+	  }
+    }
 
-      if (revert == false)
-	{
-	  sender = utxomap[sender_key];
-	  receiver = utxomap[receiver_key];
-	}
-      else
-	{
-	  sender = utxomap[receiver_key];
-	  receiver = utxomap[sender_key];
-	}
-      
-      unsigned char result[32], result2[32];
+  if (numthreads <= 1 || numtxinblock < EXEC_PARALLEL_MIN)
+    {
+      for (idx = 0; idx < numtxinblock; idx++)
+	if (trans_exec_one(state, data, parties.data(), revert ? numtxinblock - 1 - idx : idx, revert))
+	  nbr++;
+      return (nbr);
+    }
 
-      //wallet_print("Before transaction: ", sender.amount, curtrans->amount, receiver.amount);
-      
-      string_sub(sender.amount, curtrans->amount, result);
-      string_add(receiver.amount, curtrans->amount, result2);
-      memcpy(sender.amount, result, 32);
-      memcpy(receiver.amount, result2, 32);
+  // Pages written by the block are copied here, so that threads only write pages of their own
+  for (idx = 0; idx < 2 * numtxinblock; idx++)
+    if (parties[idx] >= 0)
+      account_write(state, parties[idx]);
 
-      if (revert == false)
-	{
-	  utxomap[sender_key] = sender;
-	  utxomap[receiver_key] = receiver;
-	}
-      else
-	{
-	  utxomap[sender_key] = receiver;
-	  utxomap[receiver_key] = sender;
-	}
-      
-      //wallet_print("After transaction: ", sender.amount, curtrans->amount, receiver.amount);
-      nbr++;
-     }
-  
+  // Union the accounts of every transaction, then size the groups by their root
+  std::vector<int>	parent(state.count);
+  std::vector<int>	load(state.count, 0);
+  std::vector<std::pair<int, int> > groups;
+
+  for (ullint acc = 0; acc < parent.size(); acc++)
+    parent[acc] = acc;
+  for (idx = 0; idx < numtxinblock; idx++)
+    if (parties[2 * idx] >= 0 && parties[2 * idx + 1] >= 0)
+      {
+	int first = trans_exec_root(parent, parties[2 * idx]);
+	int second = trans_exec_root(parent, parties[2 * idx + 1]);
+	if (first != second)
+	  parent[std::max(first, second)] = std::min(first, second);
+      }
+  for (idx = 0; idx < numtxinblock; idx++)
+    if (parties[2 * idx] >= 0 && parties[2 * idx + 1] >= 0)
+      {
+	int root = trans_exec_root(parent, parties[2 * idx]);
+	load[root]++;
+      }
+  for (ullint acc = 0; acc < load.size(); acc++)
+    if (load[acc] != 0)
+      groups.push_back(std::make_pair(load[acc], (int) acc));
+
+  // Largest groups first, each to the least loaded slot. load then maps a root to its slot
+  std::vector<execslot_t>	slots(std::min((ullint) numthreads, (ullint) groups.size() + 1));
+  std::vector<ullint>		slotload(slots.size(), 0);
+
+  std::sort(groups.rbegin(), groups.rend());
+  for (ullint cur = 0; cur < groups.size(); cur++)
+    {
+      ullint least = std::min_element(slotload.begin(), slotload.end()) - slotload.begin();
+      slotload[least] += groups[cur].first;
+      load[groups[cur].second] = least;
+    }
+
+  // Transactions of a group keep their relative order inside the list of their slot
+  // Those with an unknown account only log, from slot 0
+  for (idx = 0; idx < numtxinblock; idx++)
+    {
+      int	cur = revert ? numtxinblock - 1 - idx : idx;
+      int	slot = 0;
+
+      if (parties[2 * cur] >= 0 && parties[2 * cur + 1] >= 0)
+	slot = load[trans_exec_root(parent, parties[2 * cur])];
+      slots[slot].txs.push_back(cur);
+    }
+
+  // The calling thread takes slot 0
+  for (ullint cur = 0; cur < slots.size(); cur++)
+    {
+      slots[cur].state = &state;
+      slots[cur].data = data;
+      slots[cur].parties = parties.data();
+      slots[cur].revert = revert;
+      slots[cur].executed = 0;
+      if (cur > 0 && slots[cur].txs.empty() == false &&
+	  pthread_create(&slots[cur].tid, NULL, trans_exec_thread, &slots[cur]) != 0)
+	FATAL("FAILED block execution pthread_create");
+    }
+  trans_exec_thread(&slots[0]);
+  for (ullint cur = 0; cur < slots.size(); cur++)
+    {
+      if (cur > 0 && slots[cur].txs.empty() == false)
+	pthread_join(slots[cur].tid, NULL);
+      nbr += slots[cur].executed;
+    }
   return (nbr);
 }
 
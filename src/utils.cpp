@@ -35,26 +35,15 @@ bool	smaller_than(unsigned char first[32], unsigned char second[32])
 {
   int index;
 
-  std::string fst = tag2str(first);
-  std::string snd = tag2str(second);
-  
   for (index = 0; index < 32; index++)
     if (first[index] == second[index])
       continue;
     else if (first[index] < second[index])
-      {
-	//std::cerr << fst << " IS SMALLER THAN " << snd << std::endl;
-	return (true);
-      }
+      return (true);
     else
-      {
-	//std::cerr << fst << " IS NOT SMALLER THAN " << snd << std::endl;
-	return (false);
-      }
+      return (false);
 
   // Happen when both values are equal
-  //std::cerr << "FST = " << fst << std::endl;
-  //std::cerr << "SND = " << snd << std::endl;
   return (false);
 }
 
@@ -70,35 +59,48 @@ bool	is_zero(unsigned char tag[32])
 
 
 
-// Sub integers encoded with 32B arrays
-void	string_sub(unsigned char sender_amount[32],
-		   unsigned char amount_to_sub[32],
-		   unsigned char *output)
+// Parse the 32 decimal digits of a wire amount. Return false if one is not a digit
+bool	amount_load(unsigned char digits[32], amount_t *value)
 {
-  unsigned char	carry = 0;
-  for (int index = 31; index >= 0; index--)
+  amount_t	result = 0;
+
+  for (int index = 0; index < 32; index++)
     {
-      unsigned char cursender = sender_amount[index] - '0';
-      unsigned char curtosub  = amount_to_sub[index] + carry - '0';
-      if (cursender < curtosub)
-	{
-	  carry = 1;
-	  cursender += 10;
-	}
-      else
-	carry = 0;
-   
-      unsigned int  result    = (cursender - curtosub);
-
-      if (result > 9)
-	std::cerr << "sub result is bigger than 10 - this should never happen!" << std::endl;
-      
-      output[index] = result + '0';
+      unsigned int digit = digits[index] - '0';
+      if (digit > 9)
+	return (false);
+      result = result * 10 + digit;
     }
-  
-  //if (carry)
-  //std::cerr << "WARNING: SUB Account amount underflow (not enough funds)" << std::endl;
+  *value = result;
+  return (true);
+}
 
+
+// Write an amount as 32 decimal digits
+void	amount_store(unsigned char digits[32], amount_t value)
+{
+  for (int index = 31; index >= 0; index--, value /= 10)
+    digits[index] = '0' + (unsigned int) (value % 10);
+}
+
+
+// Add amounts. Return false, leaving output unchanged, above AMOUNT_MAX
+bool	amount_add(amount_t first, amount_t second, amount_t *output)
+{
+  if (first > AMOUNT_MAX || second > AMOUNT_MAX - first)
+    return (false);
+  *output = first + second;
+  return (true);
+}
+
+
+// Subtract amounts. Return false, leaving output unchanged, when second is larger
+bool	amount_sub(amount_t first, amount_t second, amount_t *output)
+{
+  if (second > first)
+    return (false);
+  *output = first - second;
+  return (true);
 }
 
 // Translate the 32B array representation into a C++ string
@@ -145,32 +147,6 @@ void	wallet_print(const char *prefix,
 }
 
 
-// Addition over integers encoded on 32B arrays
-void	string_add(unsigned char sender_amount[32],
-		   unsigned char amount_to_add[32],
-		   unsigned char *output)
-{
-  unsigned char	carry = 0;
-  for (int index = 31; index >= 0; index--)
-    {
-      unsigned char cursender = sender_amount[index] - '0';
-      unsigned char curtoadd  = amount_to_add[index] - '0';
-      unsigned int  result    = (cursender + curtoadd) + carry;
-      if (result > 9)
-	{
-	  carry = 1;
-	  result = result - 10;
-	}
-      else
-	carry = 0;
-      output[index] = '0' + result;
-    }
-  
-  //if (carry)
-  //std::cerr << "WARNING: ADD Account amount overflow! (wallet is full)" << std::endl;
-  
-}
-
 // Increment integer in 32B encoding 
 void	string_integer_increment(char *buff, int len)
 {
@@ -204,7 +180,33 @@ void	string_integer_decrement(char *buff, int len)
 }
 
 
+// Big endian loads and stores of binary header fields
+uint	be32_load(unsigned char *buff)
+{
+  return (((uint) buff[0] << 24) | ((uint) buff[1] << 16) | ((uint) buff[2] << 8) | buff[3]);
+}
+
+void	be32_store(unsigned char *buff, uint val)
+{
+  for (int idx = 3; idx >= 0; idx--, val >>= 8)
+    buff[idx] = val & 0xFF;
+}
+
+ullint	be64_load(unsigned char *buff)
+{
+  return (((ullint) be32_load(buff) << 32) | be32_load(buff + 4));
+}
+
+void	be64_store(unsigned char *buff, ullint val)
+{
+  be32_store(buff, val >> 32);
+  be32_store(buff + 4, (uint) val);
+}
+
+
 // Perform asynchronous send with retry until socket is ready
+// The socket map lock is held until the data is sent or cached, so that messages sent
+// on one socket by concurrent threads never interleave
 int	async_send(int fd, char *buff, int len, const char *errstr, bool verb)
 {
 
@@ -222,7 +224,6 @@ int	async_send(int fd, char *buff, int len, const char *errstr, bool verb)
 		  << " was cached in outbound wsockmap" << std::endl;
       return (0);
     }
-  pthread_mutex_unlock(&sockmap_lock);
 
   int sent = send(fd, buff, len, 0);
 
@@ -233,7 +234,6 @@ int	async_send(int fd, char *buff, int len, const char *errstr, bool verb)
       // << offset << " bytes when expected was " << len << std::endl;
       //usleep(100);
 
-      pthread_mutex_lock(&sockmap_lock);
       std::string str("");
       str.append(buff, len);
       wsockmap[fd] = str;
@@ -242,7 +242,6 @@ int	async_send(int fd, char *buff, int len, const char *errstr, bool verb)
 	std::cerr << "data send on sock " << fd
 		  << " was cached in outbound wsockmap after failed send" << std::endl;
       
-      pthread_mutex_unlock(&sockmap_lock);
       sent = 0;
     }
 
@@ -250,7 +249,6 @@ int	async_send(int fd, char *buff, int len, const char *errstr, bool verb)
   else if (sent != len)
     {
 
-      pthread_mutex_lock(&sockmap_lock);
       std::string str("");
       str.append(buff + sent, len - sent);
       wsockmap[fd] = str;
@@ -259,21 +257,19 @@ int	async_send(int fd, char *buff, int len, const char *errstr, bool verb)
 	std::cerr << "data to send on sock " << fd
 		  << " was partially cached in outbound wsockmap" << std::endl;
       
-      pthread_mutex_unlock(&sockmap_lock);
     }
 
   // We sent everything - cleanup rsockmap for this socket
   else
     {
-      pthread_mutex_lock(&sockmap_lock);
 
       if (verb)
 	std::cerr << "data on sock " << fd
 		  << " was fully sent - returning." << std::endl;
       
       wsockmap.erase(fd);
-      pthread_mutex_unlock(&sockmap_lock);
     }
+  pthread_mutex_unlock(&sockmap_lock);
     
   return (sent);
 }
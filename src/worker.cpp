@@ -8,9 +8,44 @@ clientmap_t	clientmap;
 UTXO		utxomap;
 
 // Current transaction pool and past pool (already committed)
-mempool_t	transpool;
-mempool_t	past_transpool;
-pthread_mutex_t transpool_lock = PTHREAD_MUTEX_INITIALIZER;
+// The mempool is split in shards so that admissions do not serialize on one lock
+// transcount is the number of transactions waiting in all shards
+mempoolshard_t		transshards[MEMPOOL_SHARDS];
+spendshard_t		transspends[MEMPOOL_SHARDS];
+std::atomic<ullint>	transcount(0);
+unsigned int		transpast = 0;
+
+// Threads executing the transactions of a block
+unsigned int		execthreads = 1;
+
+// Undo journals and state snapshots of the last committed blocks, oldest first in the order lists
+pthread_mutex_t		undo_lock = PTHREAD_MUTEX_INITIALIZER;
+undomap_t		blockundo;
+std::deque<std::string>	blockundoorder;
+statemap_t		blockstate;
+std::deque<std::string>	blockstateorder;
+
+// Mempool budget and load shedding counters
+ullint			transmax = 0;
+std::atomic<ullint>	transevicted(0);
+std::atomic<ullint>	transshed(0);
+
+// Ids of accepted transactions waiting to be announced, since transrelaystart (usec)
+// Ids known by each remote node, keyed by its lowest listening port, the node of each remote
+// port as announced in its INV messages, and ids requested from peers with the time of the request
+pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+std::vector<ullint> transrelay;
+ullint		transrelaystart = 0;
+peerinvmap_t	transknown;
+std::map<int, int> transpeers;
+std::unordered_map<ullint, ullint> transwanted;
+
+// Transpool sorted by timestamp then content, and the Merkle tree of its first transactions
+// Entries before the head were taken into templates. All are protected by the template lock
+pthread_mutex_t template_lock = PTHREAD_MUTEX_INITIALIZER;
+keylist_t	transorder;
+ullint		transorderhead = 0;
+merkle_t	transtree;
 
 // The block chain is also indexed in a map for faster access by height
 blockchain_t	chain;
@@ -286,190 +321,6 @@ static int		worker_update(int port)
 }
 
 
-// Treat event when new block was mined
-static int	miner_update(worker_t *worker, blockmsg_t newblock, char *data, int numtxinblock)
-{
-  std::cerr << "MINER READ!" << std::endl;
-  
-  // Send block to all remotes
-  // This comes from a local miner so there is no verification to perform
-  for (clientmap_t::iterator it = clientmap.begin(); it != clientmap.end(); it++)
-    {
-      remote_t	remote = it->second;
-      char	c = OPCODE_SENDBLOCK;
-
-      if (worker->serv_port == remote.remote_port)
-	{
-	  std::cerr << "Do not send the block to yourself - passing" << std::endl;
-	  continue;
-	}
-      std::cerr << "Sending block to remote on sock " << remote.client_sock
-		<< " no port " << remote.remote_port << std::endl;
-      async_send(remote.client_sock, &c, 1,
-		 "Miner update", false);
-      async_send(remote.client_sock, (char *) &newblock, sizeof(newblock),
-		 "Miner update 2", false);
-      async_send(remote.client_sock, (char *) data, sizeof(transdata_t) * numtxinblock,
-		 "Miner update 3", false);
-    }
-
-  // Make sure nobody can touch the chain while we execute transaction and stack new block
-  //std::cerr << "Acquiring chain lock..." << std::endl;
-  pthread_mutex_lock(&chain_lock);
-  //std::cerr << "Acquired chain lock..." << std::endl;
-
-  // Transactions are marked as past instead of pending
-  //std::cerr << "Acquiring trans lock..." << std::endl;
-  pthread_mutex_lock(&transpool_lock);
-  //std::cerr << "Acquired trans lock..." << std::endl;
-
-  // Always clean past transpool before it gets too big
-  // e.g. past transpool contains only most recent past block
-  past_transpool.clear();
-  past_transpool.insert(worker->miner.pending.begin(), worker->miner.pending.end());
-  worker->miner.pending.clear();
-
-  //std::cerr << "Releasing translock..." << std::endl;
-  pthread_mutex_unlock(&transpool_lock);
-  
-  // Execute all transactions of the block
-  trans_exec((transdata_t *) data, numtxinblock, false);
-
-  // Some debug
-  std::string hash  = hash2str(newblock.hash);
-  std::string phash = hash2str(newblock.priorhash);
-  std::cerr << "Miner pushing new block: " << std::endl
-	    << " new top hash       = " << hash << std::endl
-	    << " new top prior hash = " << phash << std::endl;
-  
-  // Create block and push it on chain
-  block_t    chain_elem;
-  chain_elem.hdr = newblock;
-  chain_elem.trans = (transdata_t *) data;
-  chain.push(chain_elem);
-  std::string height = tag2str(newblock.height);
-  bmap[height] = chain_elem;
-
-  // Statistics on performance
-  time_t curtime;
-  time(&curtime);
-  if (time_first_block == 0)
-    time_first_block = curtime;
-  if (time_last_block == 0)
-    time_last_block = curtime;
-  double since_first_block = difftime(curtime, time_first_block); 
-  double since_last_block  = difftime(curtime, time_last_block);
-  time_last_block = curtime;
-  std::string curheight = tag2str(newblock.height);
-  std::cerr << "CHAIN/ACCOUNTS UPDATE : new current height = " << curheight
-	    << " on port " << worker->serv_port
-	    << " SEC_SINCE_LAST:  " << since_last_block
-	    << " SEC_SINCE_FIRST: " << since_first_block
-	    << std::endl;
-  std::cerr << "STATS:" << curheight << "," << since_first_block << std::endl;
-
-  // Done updating the chain
-  //std::cerr << "Releasing chain lock..." << std::endl;
-  pthread_mutex_unlock(&chain_lock);
-  
-  return (0);
-}
-
-// Perform the action of mining. Write result on socket when available
-static int	do_mine_hash(char *buff, int len, int difficulty, char *hash)
-{
-  int 		idx;
-  
-  sha256((unsigned char*) buff, len, (unsigned char *) hash);      
-  for (idx = 0; idx < difficulty; idx++)
-    {
-      char c = hash[31 - idx];
-      if (c != '0')
-	return (-1);
-    }
-  return (0);
-}
-
-
-// Perform the action of mining: 
-int		do_mine(worker_t *worker, int difficulty, int numtxinblock)
-{
-  miner_t	newminer;
-  
-  newminer.tid = pthread_self();
-
-  //std::cerr << "Acquiring trans lock..." << std::endl;
-  pthread_mutex_lock(&transpool_lock);
-  //std::cerr << "Acquired trans lock..." << std::endl;
-  newminer.pending.insert(transpool.begin(), transpool.end());
-  transpool.clear();
-  //std::cerr << "Releasing transpool lock..." << std::endl;
-  pthread_mutex_unlock(&transpool_lock);
-
-  worker->miner = newminer;
-  
-  unsigned char  hash[32];
-  blockmsg_t     newblock;
-  
-  if (false == chain.empty())
-    {
-      block_t      lastblock = chain.top();
-      blockmsg_t   header    = lastblock.hdr;
-      memcpy(newblock.priorhash, header.hash, sizeof(newblock.priorhash));
-      memcpy(newblock.height, header.height, sizeof(newblock.height));
-      string_integer_increment((char *) newblock.height, sizeof(newblock.height));
-    }
-  else
-    {
-      unsigned char	  priorhash[32];
-      memset(priorhash, '0', sizeof(priorhash));
-      sha256(priorhash, sizeof(priorhash), newblock.priorhash);
-      memset(newblock.height, '0', sizeof(newblock.height));
-    }      
-  sha256_mineraddr(newblock.mineraddr);
-  
-  char		*buff;
-  blockhash_t	*data;
-  int		len;
-  
-  // Prepare for hashing
-  len = sizeof(blockhash_t) + sizeof(transdata_t) * numtxinblock;
-  buff = (char *) malloc(len);
-  if (buff == NULL)
-    FATAL("FAILED miner malloc");
-  data = (blockhash_t *) buff;
-  memset(data->nonce, '0', sizeof(data->nonce));
-  
-  memcpy(data->priorhash, newblock.priorhash, 32);
-  memcpy(data->height, newblock.height, 32);
-  memcpy(data->mineraddr, newblock.mineraddr, 32);
-  
-  // Copy transaction buffer into block to mine
-  int off = sizeof(blockhash_t);
-  for (mempool_t::iterator it = newminer.pending.begin(); it != newminer.pending.end(); it++)
-    {
-      transmsg_t cur = it->second;
-      transdata_t curdata = cur.data;
-      
-      memcpy(buff + off, &curdata, sizeof(curdata));
-      off += sizeof(transdata_t);
-    }
-  
-  // Mine
-  while (do_mine_hash(buff, len, difficulty, (char *) hash) < 0)
-    string_integer_increment((char *) data->nonce, sizeof(data->nonce));	      
-  memcpy(newblock.hash, hash, sizeof(newblock.hash));
-  
-  std::cerr << "WORKER on port " << worker->serv_port << " MINED BLOCK!" << std::endl;
-  
-  miner_update(worker, newblock, ((char *) buff) + sizeof(blockhash_t), numtxinblock);
-  worker->miner.tid = 0;
-  
-  // Return to main loop
-  return (0);
-}
-
-
 // Go ahead and listen to new requests
 static int	client_update_new(worker_t *worker, int client_sock,
 				  unsigned int numtxinblock, int difficulty)
@@ -510,7 +361,94 @@ static int	client_update_new(worker_t *worker, int client_sock,
       	FATAL("Not enough bytes in SENDTRANS message");
       trans.hdr.opcode = OPCODE_SENDTRANS;
       trans.data = data;
-      trans_verify(worker, trans, numtxinblock, difficulty);
+      trans_verify(worker, client_sock, trans, numtxinblock, difficulty);
+      return (0);
+      break;
+
+      // Send transaction batch opcode
+    case OPCODE_SENDTRANSBATCH:
+      {
+	unsigned char	countbuf[4];
+	unsigned int	count;
+
+	len = async_read(client_sock, (char *) countbuf, sizeof(countbuf), "SENDTRANSBATCH read failed");
+	if (len != (int) sizeof(countbuf))
+	  FATAL("Not enough bytes in SENDTRANSBATCH message 1");
+	count = be32_load(countbuf);
+	if (count == 0 || count > TRANS_BATCH_MAX)
+	  {
+	    std::cerr << "SENDTRANSBATCH with invalid count " << count << " - closing socket" << std::endl;
+	    return (-1);
+	  }
+	std::vector<transdata_t> batch(count);
+	len = async_read(client_sock, (char *) batch.data(), count * sizeof(transdata_t),
+			 "SENDTRANSBATCH read failed");
+	if (len != (int) (count * sizeof(transdata_t)))
+	  FATAL("Not enough bytes in SENDTRANSBATCH message 2");
+	trans_verify_batch(worker, client_sock, batch.data(), count, numtxinblock, difficulty);
+      }
+      return (0);
+      break;
+
+      // Transaction inventory opcode - request the ones we lack
+    case OPCODE_INV:
+      {
+	unsigned char	countbuf[4];
+	unsigned int	numports;
+	unsigned int	count;
+
+	len = async_read(client_sock, (char *) countbuf, sizeof(countbuf), "INV read failed");
+	if (len != (int) sizeof(countbuf))
+	  FATAL("Not enough bytes in INV message 1");
+	numports = be32_load(countbuf);
+	if (numports == 0 || numports > TRANS_INV_PORTS_MAX)
+	  {
+	    std::cerr << "INV with invalid port count " << numports << " - closing socket" << std::endl;
+	    return (-1);
+	  }
+	std::vector<unsigned char> ports(numports * 4);
+	len = async_read(client_sock, (char *) ports.data(), ports.size(), "INV read failed");
+	if (len != (int) ports.size())
+	  FATAL("Not enough bytes in INV message 2");
+	len = async_read(client_sock, (char *) countbuf, sizeof(countbuf), "INV read failed");
+	if (len != (int) sizeof(countbuf))
+	  FATAL("Not enough bytes in INV message 3");
+	count = be32_load(countbuf);
+	if (count == 0 || count > TRANS_INV_MAX)
+	  {
+	    std::cerr << "INV with invalid count " << count << " - closing socket" << std::endl;
+	    return (-1);
+	  }
+	std::vector<unsigned char> ids(count * 8);
+	len = async_read(client_sock, (char *) ids.data(), ids.size(), "INV read failed");
+	if (len != (int) ids.size())
+	  FATAL("Not enough bytes in INV message 4");
+	trans_inv_receive(client_sock, ports.data(), numports, ids.data(), count);
+      }
+      return (0);
+      break;
+
+      // Transaction request opcode - answer with a transaction batch
+    case OPCODE_GETDATA:
+      {
+	unsigned char	countbuf[4];
+	unsigned int	count;
+
+	len = async_read(client_sock, (char *) countbuf, sizeof(countbuf), "GETDATA read failed");
+	if (len != (int) sizeof(countbuf))
+	  FATAL("Not enough bytes in GETDATA message 1");
+	count = be32_load(countbuf);
+	if (count == 0 || count > TRANS_INV_MAX)
+	  {
+	    std::cerr << "GETDATA with invalid count " << count << " - closing socket" << std::endl;
+	    return (-1);
+	  }
+	std::vector<unsigned char> ids(count * 8);
+	len = async_read(client_sock, (char *) ids.data(), ids.size(), "GETDATA read failed");
+	if (len != (int) ids.size())
+	  FATAL("Not enough bytes in GETDATA message 2");
+	trans_getdata_receive(client_sock, ids.data(), count);
+      }
       return (0);
       break;
 
@@ -530,7 +468,7 @@ static int	client_update_new(worker_t *worker, int client_sock,
       len = async_read(client_sock, (char *) transdata, numtxinblock * 128, "sendblock read (2)");
       if (len != (int) numtxinblock * 128)
       	FATAL("Not enough bytes in SENDBLOCK message 2");
-      chain_store(block, transdata, numtxinblock, worker->serv_port);
+      chain_store(block, transdata, numtxinblock, worker->serv_port, difficulty);
       return (0);
       break;
 
@@ -562,11 +500,14 @@ static int	client_update_new(worker_t *worker, int client_sock,
 		<< " topprior    = " << topprior << std::endl
 		<< std::endl;
 
-      opcode = OPCODE_SENDBLOCK;
-      async_send(client_sock, (char *) &opcode, 1, "GETBLOCK send 1", false);
-      async_send(client_sock, (char *) &blk.hdr, sizeof(blk.hdr), "GETBLOCK send 2", false);
-      async_send(client_sock, (char *) blk.trans, sizeof(transdata_t) * numtxinblock,
-		 "GETBLOCK send 2", false);
+      // One message, so that other senders on this socket cannot split it
+      {
+	std::string	blockmsg(1, OPCODE_SENDBLOCK);
+
+	blockmsg.append((char *) &blk.hdr, sizeof(blk.hdr));
+	blockmsg.append((char *) blk.trans, sizeof(transdata_t) * numtxinblock);
+	async_send(client_sock, (char *) blockmsg.data(), blockmsg.size(), "GETBLOCK send", false);
+      }
       std::cerr << "GETBLOCK SENT ANSWER" << std::endl;
       return (0);
       break;
@@ -595,6 +536,13 @@ static int	client_update_new(worker_t *worker, int client_sock,
       return (0);
       break;
 
+      // A node we relayed transactions to is dropping some of them
+    case OPCODE_POOLFULL:
+      std::cerr << "POOLFULL OPCODE: remote mempool on sock " << client_sock
+		<< " is shedding load" << std::endl;
+      return (0);
+      break;
+
       // Send ports opcode (only sent via boot node generally)
     case OPCODE_SENDPORTS:
       std::cerr << "SENDPORT OPCODE " << std::endl;
@@ -659,17 +607,12 @@ void		UTXO_init()
     {
       char	     buff[4];
       unsigned char  hash[32];
-      account_t	     acc;
       int	     len;
-      std::string    key;
       
-      memset(&acc, 0x00, sizeof(acc));
       memset(buff, 0x00, sizeof(buff));
       len = snprintf(buff, sizeof(buff), "%u", predef);
       sha256((unsigned char*) buff, len, hash);
-      memcpy(acc.amount, "00000000000000000000000000100000", 32);
-      key = hash_binary_to_string(hash);
-      utxomap[key] = acc;
+      account_create(hash, 100000);
     }
 
   std::cerr << "Finished initializing UTXO" << std::endl;
@@ -735,7 +678,8 @@ static void		worker_socket_update(worker_t* worker, int client_sock, int numtxin
 
 // Main procedure for node in worker mode
 void	  execute_worker(unsigned int numtxinblock, unsigned int difficulty,
-			 unsigned int numworkers, unsigned int numcores, std::list<int> ports)
+			 unsigned int numworkers, unsigned int numcores, std::list<int> ports,
+			 minerconf_t minerconf, unsigned int maxpool, bool journal)
 {
   int	  err = 0;
   int     boot_sock;
@@ -747,10 +691,15 @@ void	  execute_worker(unsigned int numtxinblock, unsigned int difficulty,
   std::cout << "Executing in worker mode" << std::endl;
 
   UTXO_init();
+  trans_pool_init(maxpool, numtxinblock);
   FD_ZERO(&readset);
 
   if (numcores == 0)
     numcores = 1;
+  if (minerconf.numthreads == 0)
+    minerconf.numthreads = numcores;
+  execthreads = numcores;
+  miner_init(minerconf);
   
   // Connect to bootstrap node
   boot_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -810,11 +759,11 @@ void	  execute_worker(unsigned int numtxinblock, unsigned int difficulty,
 
       newworker.serv_sock = serv_sock;
       newworker.serv_port = port;
-      newworker.miner.tid = 0;
+      newworker.miner = NULL;
       newworker.state.added = NULL;
-      newworker.state.dropped = NULL;
       worker_zero_state(newworker);      
       workermap[port] = newworker;
+      workermap[port].miner = miner_register(&workermap[port]);
 
       // Advertize new worker to bootstrap node
       bootmsg_t msg;
@@ -822,6 +771,13 @@ void	  execute_worker(unsigned int numtxinblock, unsigned int difficulty,
       async_send(boot_sock, (char *) &msg, sizeof(msg), "BOOTMSG", false);
     }
 
+  // Reload the mempool saved by the previous run of this node, named after its first port
+  if (journal)
+    {
+      std::string path = "mempool-" + std::to_string(ports.front()) + ".journal";
+      journal_load(path.c_str(), &workermap[ports.front()], numtxinblock, difficulty);
+    }
+
   // Create all threads
   for (unsigned int idx = 0; idx < numcores; idx++)
     thread_create();
@@ -833,6 +789,10 @@ void	  execute_worker(unsigned int numtxinblock, unsigned int difficulty,
       struct timeval tv;
       tv.tv_sec = 0;
       tv.tv_usec = 1;
+
+      // Send out relayed transactions and journal records whose flush window is over
+      trans_relay_flush(false);
+      journal_flush(false);
       
       // Reset the read set
       max = reset_fdsets(boot_sock);